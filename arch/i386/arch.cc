@@ -1,10 +1,23 @@
 #include "arch/i386/include/arch.h"
 
+#include "arch/i386/cpu.h"
+#include "arch/i386/fpu.h"
+#include "arch/i386/gdt.h"
+#include "arch/i386/idt.h"
 #include "arch/i386/page-table-root.h"
 #include "arch/i386/page-table.h"
+#include "arch/i386/tlb.h"
+#include "core/macros.h"
 #include "core/mm.h"
+#include "libc/macros.h"
 
 namespace arch {
+namespace {
+
+constexpr u32 kCr4Pse = 1 << 4;
+constexpr u32 kCr4Pge = 1 << 7;
+
+}  // namespace
 
 extern "C" const char __text_begin;
 extern "C" const char __text_end;
@@ -15,61 +28,48 @@ extern "C" const char __rodata_end;
 extern "C" PageDirectory __boot_page_directory;
 extern "C" PageTable __boot_page_table1;
 
-Pages g_boot_pd_pages;
-PageTableRoot g_boot_pt_root(&__boot_page_directory,
-                             PagesRef{&g_boot_pd_pages});
-
-// Page table allocation requires page tables to be mapped so we can set them.
-// We need a page table to be able to map memory.
-//
-// To solve chicken/egg problem use a single static page table.
-//
-// TODO(bcf): To permanently fix this, we need to make sure to never run out of
-// kernel VA page tables.
-//
-// TODO(bcf): Malloc needs to do this too, since page allocation requires heap
-// allaction, we need to make sure heap never completely runs out.
-alignas(PAGE_SIZE) PageTable g_heap_pt0;
-Pages g_heap_pt0_pages;
+PageTableRoot g_boot_pt_root(
+    &__boot_page_directory,
+    PhysAddr(reinterpret_cast<uintptr_t>(&__boot_page_directory) -
+             KERNEL_HIGH_VA));
 
 void Init() {
-  {
-    // Make sure we never try to deallocate this "Page".
-    g_boot_pd_pages.IncRef();
-    auto boot_pd_va = reinterpret_cast<uintptr_t>(&__boot_page_directory);
-    g_boot_pd_pages.va = VirtAddr(boot_pd_va);
-    g_boot_pd_pages.pa = PhysAddr(boot_pd_va - KERNEL_HIGH_VA);
-    g_boot_pd_pages.count = 1;
+  InitCpuFeatures();
+  InitGdt();
+  InitIdt();
+  InitFpu();
+
+  // Enable large pages (CR4.PSE) and global pages (CR4.PGE) where supported.
+  u32 cr4_bits = 0;
+  if (cpu_features().pse) {
+    cr4_bits |= kCr4Pse;
   }
-  {
-    // Make sure we never try to deallocate this "Page".
-    g_heap_pt0_pages.IncRef();
-    auto heap_pt0_va = reinterpret_cast<uintptr_t>(&g_heap_pt0);
-    g_heap_pt0_pages.va = VirtAddr(heap_pt0_va);
-    g_heap_pt0_pages.pa = PhysAddr(heap_pt0_va - KERNEL_HIGH_VA);
-    g_heap_pt0_pages.count = 1;
-
-    for (auto& item : g_heap_pt0.entries) {
-      item.bits = 0;
-    }
-
-    int pde_idx = KERNEL_HEAP_VA / PageTable::kBytes;
-    g_boot_pt_root.page_table_pages()[pde_idx] = PagesRef(&g_heap_pt0_pages);
-    g_boot_pt_root.SetPde(pde_idx, g_heap_pt0_pages.pa);
+  if (cpu_features().pge) {
+    cr4_bits |= kCr4Pge;
   }
+  asm("movl %%cr4, %%eax;"
+      "orl %0, %%eax;"
+      "movl %%eax, %%cr4;"
+      :
+      : "r"(cr4_bits)
+      : "%eax");
 
   cur_page_table = &g_boot_pt_root;
 
   // Clear identity mappings.
   __boot_page_directory[0].bits = 0;
 
-  // Clear mappings from before `KernelBegin()`.
-  assert(KernelBegin() % PAGE_SIZE == 0);
-  int kernel_begin_idx = KernelBegin() / PAGE_SIZE;
-  assert(kernel_begin_idx < PageTable::kSize);
-
-  for (int i = 0; i < kernel_begin_idx; ++i) {
-    __boot_page_table1[i].bits = 0;
+  // The boot page table becomes the first slot of the direct map.
+  for (int i = 0; i < PageTable::kSize; ++i) {
+    auto& pte = __boot_page_table1[i];
+    if (!pte.present) {
+      PageTableEntry new_pte;
+      new_pte.bits = 0;
+      new_pte.addr = i;
+      new_pte.writable = true;
+      new_pte.present = true;
+      pte.bits = new_pte.bits;
+    }
   }
 
   // Make text read only.
@@ -86,7 +86,24 @@ void Init() {
     __boot_page_table1[pt_idx].writable = false;
   }
 
-  FlushTlb();
+  // The kernel image is mapped in every address space.
+  for (auto& pte : __boot_page_table1.entries) {
+    if (pte.present) {
+      pte.global = true;
+    }
+  }
+
+  FlushAllTlb();
+
+  // Map the rest of the direct map with large pages.
+  const uintptr_t direct_map_end =
+      ROUND_UP_TO(mm::DirectMapEnd(), LARGE_PAGE_SIZE);
+  if (direct_map_end > LARGE_PAGE_SIZE) {
+    int err = g_boot_pt_root.MapAddr(
+        mm::PaToVa(PhysAddr(LARGE_PAGE_SIZE)), PhysAddr(LARGE_PAGE_SIZE),
+        (direct_map_end - LARGE_PAGE_SIZE) / PAGE_SIZE);
+    PANIC_IF(err != 0, "Failed to map the direct map\n");
+  }
 }
 
 }  // namespace arch
@@ -0,0 +1,151 @@
+#include "arch/i386/cpu.h"
+
+#include <assert.h>
+
+#include "arch/i386/memory.h"
+#include "libc/string-impl.h"
+
+namespace arch {
+namespace {
+
+// EFLAGS.ID can only be toggled when CPUID exists.
+constexpr u32 kEflagsId = 1 << 21;
+
+// CPUID leaf 1 EDX bits.
+constexpr u32 kCpuidPse = 1 << 3;
+constexpr u32 kCpuidPge = 1 << 13;
+constexpr u32 kCpuidClflush = 1 << 19;
+constexpr u32 kCpuidFxsr = 1 << 24;
+constexpr u32 kCpuidSse = 1 << 25;
+constexpr u32 kCpuidSse2 = 1 << 26;
+
+// CPUID leaf 7 EBX bits.
+constexpr u32 kCpuidErms = 1 << 9;
+
+struct CpuidRegs {
+  u32 eax;
+  u32 ebx;
+  u32 ecx;
+  u32 edx;
+};
+
+CpuidRegs Cpuid(u32 leaf, u32 subleaf = 0) {
+  CpuidRegs regs;
+  asm("cpuid;"
+      : "=a"(regs.eax), "=b"(regs.ebx), "=c"(regs.ecx), "=d"(regs.edx)
+      : "a"(leaf), "c"(subleaf));
+  return regs;
+}
+
+bool HasCpuid() {
+  u32 before;
+  u32 after;
+  asm("pushfl;"
+      "popl %0;"
+      "movl %0, %1;"
+      "xorl %2, %1;"
+      "pushl %1;"
+      "popfl;"
+      "pushfl;"
+      "popl %1;"
+      "pushl %0;"
+      "popfl;"
+      : "=&r"(before), "=&r"(after)
+      : "i"(kEflagsId)
+      : "cc");
+  return ((before ^ after) & kEflagsId) != 0;
+}
+
+void FlushAllTlbCr3() {
+  asm("movl %%cr3, %%eax;"
+      "movl %%eax, %%cr3;"
+      :
+      :
+      : "%eax", "memory");
+}
+
+// Toggling CR4.PGE flushes every entry, global ones included.
+void FlushAllTlbPge() {
+  asm("movl %%cr4, %%eax;"
+      "movl %%eax, %%ecx;"
+      "andl $~0x80, %%ecx;"
+      "movl %%ecx, %%cr4;"
+      "movl %%eax, %%cr4;"
+      :
+      :
+      : "%eax", "%ecx", "memory");
+}
+
+void ZeroPageStos(VirtAddr va) {
+  assert(va.val() % PAGE_SIZE == 0);
+
+  u32 count = PAGE_SIZE / sizeof(u32);
+  auto* dest = reinterpret_cast<u32*>(va.val());
+  asm("rep stosl;" : "+D"(dest), "+c"(count) : "a"(0) : "memory");
+}
+
+// `movnti` is part of SSE2 but only uses general purpose registers.
+void ZeroPageMovnti(VirtAddr va) {
+  assert(va.val() % PAGE_SIZE == 0);
+
+  auto* words = reinterpret_cast<u32*>(va.val());
+  for (size_t i = 0; i < PAGE_SIZE / sizeof(u32); i += 4) {
+    asm("movnti %1, (%0);"
+        "movnti %1, 4(%0);"
+        "movnti %1, 8(%0);"
+        "movnti %1, 12(%0);"
+        :
+        : "r"(words + i), "r"(0)
+        : "memory");
+  }
+
+  // Non-temporal stores are weakly ordered.
+  asm("sfence;" : : : "memory");
+}
+
+CpuFeatures g_cpu_features;
+
+}  // namespace
+
+CpuOps g_cpu_ops = {FlushAllTlbCr3, ZeroPageStos};
+
+void InitCpuFeatures() {
+  if (!HasCpuid()) {
+    return;
+  }
+
+  auto& features = g_cpu_features;
+  const u32 max_leaf = Cpuid(0).eax;
+
+  if (max_leaf >= 1) {
+    const CpuidRegs regs = Cpuid(1);
+    features.pse = regs.edx & kCpuidPse;
+    features.pge = regs.edx & kCpuidPge;
+    features.clflush = regs.edx & kCpuidClflush;
+    features.fxsr = regs.edx & kCpuidFxsr;
+    features.sse = regs.edx & kCpuidSse;
+    features.sse2 = regs.edx & kCpuidSse2;
+    if (features.clflush) {
+      // In units of 8 bytes.
+      features.clflush_size = ((regs.ebx >> 8) & 0xff) * 8;
+    }
+  }
+
+  if (max_leaf >= 7) {
+    features.erms = Cpuid(7).ebx & kCpuidErms;
+  }
+
+  if (features.pge) {
+    g_cpu_ops.flush_all_tlb = FlushAllTlbPge;
+  }
+  if (features.sse2) {
+    g_cpu_ops.zero_page = ZeroPageMovnti;
+  }
+  if (features.erms) {
+    __string_use_erms();
+  }
+}
+
+const CpuFeatures& cpu_features() { return g_cpu_features; }
+
+}  // namespace arch
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "core/types.h"
+
+namespace arch {
+
+// What the running CPU supports, from CPUID. All false on CPUs without it.
+struct CpuFeatures {
+  // 4 MiB pages.
+  bool pse = false;
+  // Global pages.
+  bool pge = false;
+  bool clflush = false;
+  // FXSAVE/FXRSTOR.
+  bool fxsr = false;
+  bool sse = false;
+  bool sse2 = false;
+  // Enhanced `rep movsb`/`rep stosb`.
+  bool erms = false;
+
+  // Bytes flushed by `clflush`, when supported.
+  u32 clflush_size = 0;
+};
+
+// Routines with a variant per CPU generation. Each starts as a variant every
+// CPU runs and is replaced by `InitCpuFeatures`, so calls never check
+// features themselves.
+struct CpuOps {
+  // Flushes the whole TLB, including global entries.
+  void (*flush_all_tlb)();
+  // Zeroes a page, bypassing the cache when the CPU can.
+  void (*zero_page)(VirtAddr va);
+};
+
+extern CpuOps g_cpu_ops;
+
+// Probes the CPU and selects `g_cpu_ops` and the string routines for it.
+void InitCpuFeatures();
+
+const CpuFeatures& cpu_features();
+
+}  // namespace arch
@@ -0,0 +1,88 @@
+#include "arch/i386/fpu.h"
+
+#include <arch.h>
+#include <assert.h>
+
+#include "arch/i386/cpu.h"
+#include "core/macros.h"
+#include "core/types.h"
+#include "libc/string-impl.h"
+
+namespace arch {
+namespace {
+
+constexpr u32 kCr0Mp = 1 << 1;
+constexpr u32 kCr0Em = 1 << 2;
+constexpr u32 kCr0Ts = 1 << 3;
+constexpr u32 kCr0Ne = 1 << 5;
+
+constexpr u32 kCr4Osfxsr = 1 << 9;
+constexpr u32 kCr4Osxmmexcpt = 1 << 10;
+
+// Sections which may be open at once: a section, an exception handler's
+// section interrupting it, and a little slack.
+constexpr int kMaxFpuDepth = 4;
+
+struct FxsaveArea {
+  alignas(16) u8 bytes[512];
+};
+
+struct FpuContext {
+  int depth = 0;
+  // Registers of the section interrupted by each nested one.
+  FxsaveArea saved[kMaxFpuDepth - 1];
+};
+
+FpuContext g_fpu_contexts[kMaxCpus];
+
+}  // namespace
+
+void InitFpu() {
+  if (!cpu_features().fxsr || !cpu_features().sse) {
+    return;
+  }
+
+  // Run FPU instructions natively, report their errors as exceptions and
+  // enable FXSAVE and SSE exceptions.
+  asm("movl %%cr0, %%eax;"
+      "andl %0, %%eax;"
+      "orl %1, %%eax;"
+      "movl %%eax, %%cr0;"
+      "movl %%cr4, %%eax;"
+      "orl %2, %%eax;"
+      "movl %%eax, %%cr4;"
+      "fninit;"
+      :
+      : "i"(~(kCr0Em | kCr0Ts)), "i"(kCr0Mp | kCr0Ne),
+        "i"(kCr4Osfxsr | kCr4Osxmmexcpt)
+      : "%eax");
+
+  // `rep movsb` is at least as fast where the CPU has ERMS.
+  if (cpu_features().sse2 && !cpu_features().erms) {
+    __string_use_sse2();
+  }
+}
+
+void KernelFpuBegin() {
+  FpuContext& context = g_fpu_contexts[CpuId()];
+  PANIC_IF(context.depth >= kMaxFpuDepth, "FPU sections nested too deep\n");
+  if (context.depth > 0) {
+    asm("fxsave %0;" : "=m"(context.saved[context.depth - 1]));
+  }
+  ++context.depth;
+}
+
+void KernelFpuEnd() {
+  FpuContext& context = g_fpu_contexts[CpuId()];
+  assert(context.depth > 0);
+  --context.depth;
+  if (context.depth > 0) {
+    asm("fxrstor %0;" : : "m"(context.saved[context.depth - 1]));
+  }
+}
+
+}  // namespace arch
+
+void __string_fpu_begin() { arch::KernelFpuBegin(); }
+
+void __string_fpu_end() { arch::KernelFpuEnd(); }
@@ -0,0 +1,19 @@
+#pragma once
+
+namespace arch {
+
+// Enables the FPU and SSE when the CPU has FXSAVE and SSE, then lets the
+// string routines use SSE2. Must run after `InitCpuFeatures`.
+//
+// TODO(bcf): Once there are threads, set CR0.TS when switching and load the
+// next thread's state from the #NM handler on its first FPU instruction.
+void InitFpu();
+
+// Brackets kernel code which uses FPU or SSE registers. Sections nest, e.g.
+// when an exception handler interrupts a section and starts its own. Only a
+// nested section saves and restores the registers, since there is no thread
+// state to preserve under the outermost one yet.
+void KernelFpuBegin();
+void KernelFpuEnd();
+
+}  // namespace arch
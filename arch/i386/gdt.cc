@@ -0,0 +1,41 @@
+#include "arch/i386/gdt.h"
+
+namespace arch {
+namespace {
+
+struct GdtPointer {
+  u16 limit;
+  u32 base;
+} __attribute__((packed));
+
+// Null, kernel code and kernel data descriptors. Both segments are flat 4 GiB,
+// ring 0, 32 bit with 4 KiB granularity.
+const u64 g_gdt[] = {
+    0,
+    0x00cf9a000000ffff,
+    0x00cf92000000ffff,
+};
+
+}  // namespace
+
+void InitGdt() {
+  const GdtPointer gdtr = {
+      sizeof(g_gdt) - 1,
+      reinterpret_cast<u32>(g_gdt),
+  };
+
+  asm("lgdt %0;"
+      "ljmp %1, $1f;"
+      "1:"
+      "movw %2, %%ax;"
+      "movw %%ax, %%ds;"
+      "movw %%ax, %%es;"
+      "movw %%ax, %%fs;"
+      "movw %%ax, %%gs;"
+      "movw %%ax, %%ss;"
+      :
+      : "m"(gdtr), "i"(kKernelCodeSelector), "i"(kKernelDataSelector)
+      : "%eax", "memory");
+}
+
+}  // namespace arch
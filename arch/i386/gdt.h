@@ -0,0 +1,14 @@
+#pragma once
+
+#include "core/types.h"
+
+namespace arch {
+
+constexpr u16 kKernelCodeSelector = 0x08;
+constexpr u16 kKernelDataSelector = 0x10;
+
+// Replaces the bootloader's GDT, which may live in memory we reuse, with flat
+// kernel code and data segments and reloads the segment registers.
+void InitGdt();
+
+}  // namespace arch
@@ -0,0 +1,82 @@
+#include "arch/i386/idt.h"
+
+#include "arch/i386/gdt.h"
+#include "core/macros.h"
+#include "core/mm.h"
+#include "libc/macros.h"
+
+extern "C" const u32 __isr_table[];
+
+namespace arch {
+namespace {
+
+constexpr int kNumExceptions = 32;
+constexpr u32 kPageFaultVector = 14;
+
+// Page fault error code bits.
+constexpr u32 kPfPresent = 1 << 0;
+constexpr u32 kPfWrite = 1 << 1;
+
+struct IdtEntry {
+  u16 offset_low;
+  u16 selector;
+  u8 zero;
+  // Present, ring 0, 32 bit interrupt gate.
+  u8 type_attr;
+  u16 offset_high;
+} __attribute__((packed));
+
+struct IdtPointer {
+  u16 limit;
+  u32 base;
+} __attribute__((packed));
+
+IdtEntry g_idt[kNumExceptions];
+
+void HandlePageFault(InterruptFrame* frame) {
+  uintptr_t addr;
+  asm("movl %%cr2, %0;" : "=r"(addr));
+
+  // Only faults on missing pages can be demand paged.
+  if (!(frame->error_code & kPfPresent) &&
+      mm::HandlePageFault(VirtAddr(addr))) {
+    return;
+  }
+
+  PANIC("Page fault at %x (%s, %s), eip: %x\n", addr,
+        frame->error_code & kPfPresent ? "protection" : "not present",
+        frame->error_code & kPfWrite ? "write" : "read", frame->eip);
+}
+
+}  // namespace
+
+void InitIdt() {
+  for (int i = 0; i < kNumExceptions; ++i) {
+    const u32 handler = __isr_table[i];
+    g_idt[i] = {
+        static_cast<u16>(handler & 0xffff),
+        kKernelCodeSelector,
+        0,
+        0x8e,
+        static_cast<u16>(handler >> 16),
+    };
+  }
+
+  const IdtPointer idtr = {
+      sizeof(g_idt) - 1,
+      reinterpret_cast<u32>(g_idt),
+  };
+  asm("lidt %0;" : : "m"(idtr));
+}
+
+}  // namespace arch
+
+extern "C" void HandleInterrupt(arch::InterruptFrame* frame) {
+  if (frame->vector == arch::kPageFaultVector) {
+    arch::HandlePageFault(frame);
+    return;
+  }
+
+  PANIC("Unhandled exception %d, error: %x, eip: %x\n", frame->vector,
+        frame->error_code, frame->eip);
+}
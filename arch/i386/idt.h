@@ -0,0 +1,32 @@
+#pragma once
+
+#include "core/types.h"
+
+namespace arch {
+
+// Stack layout built by the stubs in isr.S.
+struct InterruptFrame {
+  // pushal
+  u32 edi;
+  u32 esi;
+  u32 ebp;
+  u32 esp;
+  u32 ebx;
+  u32 edx;
+  u32 ecx;
+  u32 eax;
+
+  u32 vector;
+  // 0 for exceptions which don't push one.
+  u32 error_code;
+
+  // Pushed by the CPU.
+  u32 eip;
+  u32 cs;
+  u32 eflags;
+};
+
+// Installs handlers for the CPU exceptions.
+void InitIdt();
+
+}  // namespace arch
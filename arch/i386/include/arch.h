@@ -5,6 +5,10 @@
 #ifdef __cplusplus
 namespace arch {
 
+// TODO(bcf): Bring up the other CPUs.
+constexpr int kMaxCpus = 1;
+inline int CpuId() { return 0; }
+
 void Init();
 
 }  // namespace arch
@@ -1,7 +1,17 @@
 #pragma once
 
 #define PAGE_SIZE 4096
+
+// Size of a page mapped directly by a page directory entry.
+#define LARGE_PAGE_SIZE 0x400000
 #define KERNEL_HIGH_VA 0xc0000000
 
+// Largest amount of physical memory mapped linearly at KERNEL_HIGH_VA.
+#define DIRECT_MAP_SIZE 0x30000000
+
 // Address where we start allocating dynamic kernel VAs.
-#define KERNEL_HEAP_VA 0xc0400000
+#define KERNEL_HEAP_VA (KERNEL_HIGH_VA + DIRECT_MAP_SIZE)
+
+// Window where the current page directory maps its own page tables. Ends the
+// dynamic kernel VAs.
+#define PAGE_TABLES_VA 0xffc00000
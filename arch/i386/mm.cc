@@ -3,10 +3,12 @@
 #include <arch.h>
 #include <stdio.h>
 
+#include "arch/i386/cpu.h"
 #include "arch/i386/page-table-root.h"
 
 extern "C" const char __kernel_begin;
 extern "C" const char __kernel_end;
+extern "C" arch::PageTable __boot_page_table1;
 
 namespace arch {
 
@@ -18,24 +20,47 @@ uintptr_t KernelEnd() {
   return reinterpret_cast<uintptr_t>(&__kernel_end) - KERNEL_HIGH_VA;
 }
 
+uintptr_t BootMapEnd() { return PageTable::kSize * PAGE_SIZE; }
+
+VirtAddr MapBootPages(PhysAddr pa, size_t num_pages) {
+  assert(pa.val() % PAGE_SIZE == 0);
+  if (pa.val() + num_pages * PAGE_SIZE > BootMapEnd()) {
+    return kInvalidVa;
+  }
+
+  const uintptr_t first_idx = pa.val() / PAGE_SIZE;
+  for (size_t i = 0; i < num_pages; ++i) {
+    PageTableEntry pte;
+    pte.bits = 0;
+    pte.addr = first_idx + i;
+    pte.writable = true;
+    pte.present = true;
+
+    __boot_page_table1[first_idx + i].bits = pte.bits;
+  }
+
+  return VirtAddr(pa.val() + KERNEL_HIGH_VA);
+}
+
 void SetPageTable(PageTableRoot* page_table) {
   asm("movl %0, %%cr3;" : : "r"(page_table->directory_pa().val()) :);
   cur_page_table = page_table;
 }
 
-void FlushTlb() {
-  asm("movl %%cr3, %%eax;"
-      "movl %%eax, %%cr3;"
-      :
-      :
-      : "%eax");
-}
+void FlushTlb() { cur_page_table->FlushTlb(); }
+
+void ZeroPage(VirtAddr va) { g_cpu_ops.zero_page(va); }
 
 int MapAddr(PageTableRoot* page_table, VirtAddr va, PhysAddr pa,
             size_t num_pages) {
   return page_table->MapAddr(va, pa, num_pages);
 }
 
+int MapAddr(PageTableRoot* page_table, VirtAddr va, const PaRun* runs,
+            size_t num_runs) {
+  return page_table->MapAddr(va, runs, num_runs);
+}
+
 void UnmapAddr(PageTableRoot* page_table, VirtAddr va, size_t num_pages) {
   page_table->UnmapAddr(va, num_pages);
 }
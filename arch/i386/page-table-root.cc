@@ -1,78 +1,206 @@
 #include "arch/i386/page-table-root.h"
 
-#include <new>
+#include <string.h>
+
+#include <algorithm>
+
+#include "arch/i386/cpu.h"
+#include "arch/i386/tlb.h"
+#include "core/macros.h"
+#include "libc/macros.h"
 
 namespace arch {
 
+PageTableRoot::PageTableRoot(PageDirectory* directory, PhysAddr directory_pa)
+    : directory_(*directory), directory_pa_(directory_pa) {
+  SetPde(kSelfPdeIdx, directory_pa_);
+}
+
 int PageTableRoot::MapAddr(const VirtAddr va, const PhysAddr pa,
                            const size_t num_pages) {
-  assert(va.val() % PAGE_SIZE == 0);
-  assert(pa.val() % PAGE_SIZE == 0);
+  const PaRun run = {pa, num_pages};
+  return MapAddr(va, &run, 1);
+}
 
-  size_t i = 0;
+int PageTableRoot::MapAddr(const VirtAddr va, const PaRun* runs,
+                           const size_t num_runs) {
+  assert(cur_page_table == this);
 
-  for (; i < num_pages; ++i) {
-    int pde_idx = va.val() / PageTable::kBytes;
-    PagesRef& pt_page = page_table_pages_[pde_idx];
+  if (RefillPageTables(CountNewPageTables(va.val(), runs, num_runs)) < 0) {
+    return -1;
+  }
 
-    if (!pt_page) {
-      pt_page = mm::AllocPages(1);
-      if (!pt_page) {
-        goto error;
-      }
+  uintptr_t cur_va = va.val();
+  for (size_t i = 0; i < num_runs; ++i) {
+    MapRun(cur_va, runs[i].pa.val(), runs[i].count);
+    cur_va += runs[i].count * PAGE_SIZE;
+  }
 
-      auto* new_pt = new (reinterpret_cast<void*>(pt_page->va.val())) PageTable;
-      for (auto& entry : new_pt->entries) {
-        entry.bits = 0;
-      }
+  return 0;
+}
 
-      SetPde(pde_idx, pt_page->pa);
+int PageTableRoot::RefillPageTables(const size_t needed) {
+  if (num_reserved_tables_ >= needed + kLowWatermark) {
+    return 0;
+  }
+
+  // Not zeroed here: while `Init` builds the direct map, a frame may not be
+  // reachable through `PaToVa` yet. `MapRun` zeroes it through the window.
+  while (num_reserved_tables_ < needed + kHighWatermark) {
+    const PhysAddr pa = mm::AllocPagesPa(1);
+    if (pa == kInvalidPa) {
+      break;
     }
 
-    PageTableEntry new_pte;
-    new_pte.addr = pa.val() + i * PAGE_SIZE;
-    new_pte.writable = true;
-    new_pte.present = true;
+    reserved_tables_.push_front(mm::PaToPages(pa)->link);
+    ++num_reserved_tables_;
+  }
+
+  return num_reserved_tables_ >= needed ? 0 : -1;
+}
+
+bool PageTableRoot::UseLargePage(uintptr_t va, uintptr_t pa,
+                                 size_t num_pages) {
+  return cpu_features().pse && va % LARGE_PAGE_SIZE == 0 &&
+         pa % LARGE_PAGE_SIZE == 0 && num_pages >= PageTable::kSize &&
+         !directory_[va / PageTable::kBytes].present;
+}
+
+// Mirrors the decisions `MapRun` makes for each slot.
+size_t PageTableRoot::CountNewPageTables(uintptr_t va, const PaRun* runs,
+                                         const size_t num_runs) {
+  size_t count = 0;
+  for (size_t i = 0; i < num_runs; ++i) {
+    uintptr_t pa = runs[i].pa.val();
+    size_t num_pages = runs[i].count;
+
+    while (num_pages > 0) {
+      const int pde_idx = va / PageTable::kBytes;
+      const size_t slot_pages = std::min(
+          num_pages,
+          static_cast<size_t>(PageTable::kSize -
+                              (va % PageTable::kBytes) / PAGE_SIZE));
 
-    auto* page_table = reinterpret_cast<PageTable*>(pt_page->va.val());
-    int pte_idx = (va.val() % PageTable::kBytes) / PAGE_SIZE;
-    (*page_table)[pte_idx].bits = new_pte.bits;
+      if (!UseLargePage(va, pa, num_pages) && !HasPageTable(pde_idx)) {
+        ++count;
+      }
+
+      va += slot_pages * PAGE_SIZE;
+      pa += slot_pages * PAGE_SIZE;
+      num_pages -= slot_pages;
+    }
   }
 
-  return 0;
+  return count;
+}
+
+void PageTableRoot::MapRun(uintptr_t va, uintptr_t pa, size_t num_pages) {
+  assert(va % PAGE_SIZE == 0);
+  assert(pa % PAGE_SIZE == 0);
+  assert(va + num_pages * PAGE_SIZE <= PAGE_TABLES_VA);
+
+  while (num_pages > 0) {
+    int pde_idx = va / PageTable::kBytes;
+
+    if (UseLargePage(va, pa, num_pages)) {
+      SetLargePde(pde_idx, PhysAddr(pa), va >= KERNEL_HIGH_VA);
+      va += LARGE_PAGE_SIZE;
+      pa += LARGE_PAGE_SIZE;
+      num_pages -= PageTable::kSize;
+      continue;
+    }
+    assert(!IsLargePde(pde_idx));
 
-error:
-  UnmapAddr(va, i);
-  return -1;
+    if (!HasPageTable(pde_idx)) {
+      // Reserved by `MapAddr`.
+      int err = NewPageTable(pde_idx);
+      assert(err == 0);
+      (void)err;
+      memset(&PageTableAt(pde_idx), 0, sizeof(PageTable));
+    }
+
+    const int first_pte = (va % PageTable::kBytes) / PAGE_SIZE;
+    const int count =
+        std::min(num_pages, static_cast<size_t>(PageTable::kSize - first_pte));
+
+    PageTableEntry pte;
+    pte.bits = 0;
+    pte.addr = pa / PAGE_SIZE;
+    pte.writable = true;
+    pte.present = true;
+    // Kernel mappings are the same in every address space.
+    pte.global = va >= KERNEL_HIGH_VA;
+
+    // Consecutive PTEs only differ in their address.
+    PageTable& page_table = PageTableAt(pde_idx);
+    for (int i = 0; i < count; ++i) {
+      page_table[first_pte + i].bits = pte.bits + i * PAGE_SIZE;
+    }
+
+    va += count * PAGE_SIZE;
+    pa += count * PAGE_SIZE;
+    num_pages -= count;
+  }
 }
 
 void PageTableRoot::UnmapAddr(VirtAddr va, size_t num_pages) {
+  assert(cur_page_table == this);
   assert(va.val() % PAGE_SIZE == 0);
-  for (size_t i = 0; i < num_pages; ++i) {
-    int pde_idx = va.val() / PageTable::kBytes;
-    PagesRef& pt_page = page_table_pages_[pde_idx];
-    assert(pt_page);
 
-    auto* page_table = reinterpret_cast<PageTable*>(pt_page->va.val());
-    int pte_idx = (va.val() % PageTable::kBytes) / PAGE_SIZE;
+  uintptr_t cur_va = va.val();
+  while (num_pages > 0) {
+    int pde_idx = cur_va / PageTable::kBytes;
 
-    auto& pte = (*page_table)[pte_idx];
-    assert(pte.present);
-    pte.bits = 0;
+    if (IsLargePde(pde_idx)) {
+      if (cur_va % LARGE_PAGE_SIZE == 0 && num_pages >= PageTable::kSize) {
+        directory_[pde_idx].bits = 0;
+        AddPendingFlush(cur_va, 1);
+        cur_va += LARGE_PAGE_SIZE;
+        num_pages -= PageTable::kSize;
+        continue;
+      }
+
+      // Only part of the large page is going away.
+      PANIC_IF(SplitLargePde(pde_idx) < 0,
+               "%s: Failed to split large page at %p\n", __func__,
+               (void*)cur_va);
+    }
+
+    assert(HasPageTable(pde_idx));
+
+    const int first_pte = (cur_va % PageTable::kBytes) / PAGE_SIZE;
+    const int count =
+        std::min(num_pages, static_cast<size_t>(PageTable::kSize - first_pte));
+
+    PageTable& page_table = PageTableAt(pde_idx);
+    for (int i = 0; i < count; ++i) {
+      auto& pte = page_table[first_pte + i];
+      assert(pte.present);
+      pte.bits = 0;
+    }
+    AddPendingFlush(cur_va, count);
+
+    cur_va += count * PAGE_SIZE;
+    num_pages -= count;
   }
 }
 
 PhysAddr PageTableRoot::LookupPa(VirtAddr va) {
+  assert(cur_page_table == this);
+
   int pde_idx = va.val() / PageTable::kBytes;
-  PagesRef& pt_page = page_table_pages_[pde_idx];
-  if (!pt_page) {
+  if (IsLargePde(pde_idx)) {
+    return PhysAddr(directory_[pde_idx].addr * PAGE_SIZE +
+                    va.val() % LARGE_PAGE_SIZE);
+  }
+
+  if (!HasPageTable(pde_idx)) {
     return kInvalidPa;
   }
 
-  auto* page_table = reinterpret_cast<PageTable*>(pt_page->va.val());
   int pte_idx = (va.val() % PageTable::kBytes) / PAGE_SIZE;
 
-  auto& pte = (*page_table)[pte_idx];
+  auto& pte = PageTableAt(pde_idx)[pte_idx];
   if (!pte.present) {
     return kInvalidPa;
   }
@@ -80,13 +208,106 @@ PhysAddr PageTableRoot::LookupPa(VirtAddr va) {
   return PhysAddr(pte.addr * PAGE_SIZE);
 }
 
+void PageTableRoot::FlushTlb() {
+  if (flush_all_) {
+    FlushAllTlb();
+  } else {
+    for (int i = 0; i < num_pending_flushes_; ++i) {
+      Invlpg(pending_flushes_[i]);
+    }
+  }
+
+  num_pending_flushes_ = 0;
+  flush_all_ = false;
+}
+
+void PageTableRoot::AddPendingFlush(uintptr_t va, size_t num_pages) {
+  if (flush_all_ || num_pending_flushes_ + num_pages > kMaxPendingFlushes) {
+    flush_all_ = true;
+    return;
+  }
+
+  for (size_t i = 0; i < num_pages; ++i) {
+    pending_flushes_[num_pending_flushes_++] = VirtAddr(va + i * PAGE_SIZE);
+  }
+}
+
 void PageTableRoot::SetPde(int pde_idx, PhysAddr pa) {
   PageDirectoryEntry new_pde;
+  new_pde.bits = 0;
+  new_pde.addr = pa.val() / PAGE_SIZE;
+  new_pde.writable = true;
+  new_pde.present = true;
+
+  directory_[pde_idx].bits = new_pde.bits;
+}
+
+void PageTableRoot::SetLargePde(int pde_idx, PhysAddr pa, bool global) {
+  assert(pa.val() % LARGE_PAGE_SIZE == 0);
+
+  PageDirectoryEntry new_pde;
+  new_pde.bits = 0;
   new_pde.addr = pa.val() / PAGE_SIZE;
+  new_pde.page_size = PageSize::k4M;
+  new_pde.global = global;
   new_pde.writable = true;
   new_pde.present = true;
 
   directory_[pde_idx].bits = new_pde.bits;
 }
 
+bool PageTableRoot::HasPageTable(int pde_idx) {
+  PageDirectoryEntry pde;
+  pde.bits = directory_[pde_idx].bits;
+  return pde.present && pde.page_size == PageSize::k4K;
+}
+
+bool PageTableRoot::IsLargePde(int pde_idx) {
+  PageDirectoryEntry pde;
+  pde.bits = directory_[pde_idx].bits;
+  return pde.present && pde.page_size == PageSize::k4M;
+}
+
+int PageTableRoot::NewPageTable(int pde_idx) {
+  if (reserved_tables_.empty()) {
+    return -1;
+  }
+
+  Pages* frame = CONTAINER_OF(&*reserved_tables_.begin(), Pages, link);
+  reserved_tables_.erase(frame->link);
+  --num_reserved_tables_;
+
+  SetPde(pde_idx, frame->pa());
+
+  // Drop whatever the window showed for this slot before.
+  Invlpg(VirtAddr(reinterpret_cast<uintptr_t>(&PageTableAt(pde_idx))));
+  return 0;
+}
+
+int PageTableRoot::SplitLargePde(int pde_idx) {
+  assert(IsLargePde(pde_idx));
+
+  PageDirectoryEntry pde;
+  pde.bits = directory_[pde_idx].bits;
+
+  // Nothing may touch the large page until the new page table is filled in.
+  if (NewPageTable(pde_idx) < 0) {
+    return -1;
+  }
+
+  PageTable& page_table = PageTableAt(pde_idx);
+  for (int i = 0; i < PageTable::kSize; ++i) {
+    PageTableEntry pte;
+    pte.bits = 0;
+    pte.addr = pde.addr + i;
+    pte.global = pde.global;
+    pte.writable = true;
+    pte.present = true;
+
+    page_table[i].bits = pte.bits;
+  }
+
+  return 0;
+}
+
 }  // namespace arch
@@ -1,33 +1,94 @@
 #pragma once
 
-#include <utility>
-
 #include "arch/i386/page-table.h"
 #include "core/mm.h"
+#include "libc/intrusive-list.h"
 
 namespace arch {
 
+// Page tables of an address space.
+//
+// The last directory entry points back at the directory, so while this root is
+// loaded each slot's page table is visible at `PAGE_TABLES_VA + slot *
+// PAGE_SIZE` and finding a PTE is pure arithmetic. Page tables are owned by
+// their directory entry's PFN.
+//
+// New page tables come from a reserve of frames kept by each root. `MapAddr`
+// counts the page tables a range needs and tops up the reserve before touching
+// the directory, so the walk itself never calls into the frame allocator and
+// can only fail up front.
+//
+// TODO(bcf): Mapping into a root which isn't loaded needs a temporary window.
 class PageTableRoot {
  public:
-  explicit PageTableRoot(PageDirectory* directory, PagesRef directory_page)
-      : directory_(*directory), directory_page_(std::move(directory_page)) {}
+  PageTableRoot(PageDirectory* directory, PhysAddr directory_pa);
 
+  // These only work on the current root. Each visits a page table once per
+  // slot the range covers.
   int MapAddr(VirtAddr va, PhysAddr pa, size_t num_pages);
+  // Maps `runs` back to back starting at `va`.
+  int MapAddr(VirtAddr va, const PaRun* runs, size_t num_runs);
   void UnmapAddr(VirtAddr va, size_t num_pages);
   PhysAddr LookupPa(VirtAddr va);
 
+  // Makes sure at least `needed` page table frames are reserved. Once the
+  // reserve drops below `needed + kLowWatermark` it is refilled to `needed +
+  // kHighWatermark`. Returns -1 if fewer than `needed` could be reserved.
+  int RefillPageTables(size_t needed = 0);
+
+  // Invalidates the TLB entries of mappings removed by `UnmapAddr` since the
+  // last call. Invalidates pages one by one while there are few of them,
+  // otherwise flushes the whole TLB.
+  void FlushTlb();
+
   void SetPde(int pde_idx, PhysAddr pa);
+  void SetLargePde(int pde_idx, PhysAddr pa, bool global);
 
   PageDirectory& directory() { return directory_; }
-  PhysAddr directory_pa() { return directory_page_->pa; }
-
-  PagesRef* page_table_pages() { return page_table_pages_; }
+  PhysAddr directory_pa() { return directory_pa_; }
 
  private:
+  static constexpr int kSelfPdeIdx = PAGE_TABLES_VA / PageTable::kBytes;
+  static constexpr int kMaxPendingFlushes = 16;
+  // Enough to split the large pages at both ends of an unmapped range.
+  static constexpr size_t kLowWatermark = 2;
+  static constexpr size_t kHighWatermark = 8;
+
+  static PageTable& PageTableAt(int pde_idx) {
+    return *reinterpret_cast<PageTable*>(PAGE_TABLES_VA + pde_idx * PAGE_SIZE);
+  }
+
+  bool HasPageTable(int pde_idx);
+  bool IsLargePde(int pde_idx);
+  void AddPendingFlush(uintptr_t va, size_t num_pages);
+
+  // Whether `MapRun` maps the slot at `va` with a single large page: the slot
+  // is whole, aligned and empty, and the CPU has large pages.
+  bool UseLargePage(uintptr_t va, uintptr_t pa, size_t num_pages);
+
+  // Number of page tables `MapRun` would create for `runs`.
+  size_t CountNewPageTables(uintptr_t va, const PaRun* runs, size_t num_runs);
+
+  void MapRun(uintptr_t va, uintptr_t pa, size_t num_pages);
+
+  // Points slot `pde_idx` at a page table from the reserve. Its contents are
+  // left for the caller to fill.
+  int NewPageTable(int pde_idx);
+
+  // Replaces a large page with a page table mapping the same addresses.
+  int SplitLargePde(int pde_idx);
+
   PageDirectory& directory_;
-  PagesRef directory_page_;
+  const PhysAddr directory_pa_;
+
+  VirtAddr pending_flushes_[kMaxPendingFlushes];
+  int num_pending_flushes_ = 0;
+  // Set when `pending_flushes_` overflows.
+  bool flush_all_ = false;
 
-  PagesRef page_table_pages_[PageDirectory::kSize];
+  // Frames for new page tables, linked through their `Pages` descriptors.
+  IntrusiveList reserved_tables_;
+  size_t num_reserved_tables_ = 0;
 };
 
 }  // namespace arch
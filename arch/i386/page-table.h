@@ -25,7 +25,8 @@ struct PageDirectoryEntry {
       bool accessed : 1;
       u32 reserved2 : 1;
       PageSize page_size : 1;
-      u32 reserved1 : 1;
+      // Only for 4 MiB pages.
+      bool global : 1;
       u32 avail : 3;
       u32 addr : 20;
     };
@@ -60,7 +61,7 @@ struct PageTableEntry {
       bool accessed : 1;
       bool dirty : 1;
       u32 reserved1 : 1;
-      u32 global : 1;
+      bool global : 1;
       u32 avail : 3;
       u32 addr : 20;
     };
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "arch/i386/cpu.h"
+#include "core/types.h"
+
+namespace arch {
+
+inline void Invlpg(VirtAddr va) {
+  asm("invlpg (%0);" : : "r"(va.val()) : "memory");
+}
+
+// Flushes the whole TLB, including global entries.
+inline void FlushAllTlb() { g_cpu_ops.flush_all_tlb(); }
+
+}  // namespace arch
@@ -1,5 +1,6 @@
 #include "core/tty.h"
 
+#include <arch.h>
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -37,7 +38,7 @@ enum VgaColor {
 int g_tty_row = 0;
 int g_tty_col = 0;
 u8 g_tty_color;
-u16* g_tty_buf = reinterpret_cast<u16*>(0xc03ff000);
+u16* g_tty_buf = reinterpret_cast<u16*>(KERNEL_HIGH_VA + 0xb8000);
 
 u8 VgaEntryColor(VgaColor fg, VgaColor bg) { return fg | (bg << 4); }
 
@@ -73,6 +74,13 @@ void Scroll(int num_lines) {
   g_tty_row -= num_lines;
 }
 
+void NewLine() {
+  g_tty_col = 0;
+  if (++g_tty_row == kVgaHeight) {
+    Scroll(1);
+  }
+}
+
 }  // namespace
 
 void TtyInit(void) {
@@ -88,24 +96,40 @@ void TtyInit(void) {
 
 void TtyPutchar(char c) {
   if (c == '\n') {
-    g_tty_col = 0;
-    if (++g_tty_row == kVgaHeight) {
-      Scroll(1);
-    }
+    NewLine();
     return;
   }
 
   PutEntryAt(c, g_tty_color, g_tty_col, g_tty_row);
   if (++g_tty_col == kVgaWidth) {
-    g_tty_col = 0;
-    if (++g_tty_row == kVgaHeight) {
-      Scroll(1);
-    }
+    NewLine();
   }
 }
 
 void TtyWrite(const char* data, size_t size) {
-  while (size--) {
-    TtyPutchar(*(data++));
+  while (size > 0) {
+    if (*data == '\n') {
+      NewLine();
+      ++data;
+      --size;
+      continue;
+    }
+
+    // Fill the rest of the row up to the next newline in one go.
+    const size_t room = kVgaWidth - g_tty_col;
+    const size_t max_run = size < room ? size : room;
+    u16* const row = g_tty_buf + g_tty_row * kVgaWidth + g_tty_col;
+    size_t run = 0;
+    while (run < max_run && data[run] != '\n') {
+      row[run] = VgaEntry(data[run], g_tty_color);
+      ++run;
+    }
+
+    data += run;
+    size -= run;
+    g_tty_col += run;
+    if (g_tty_col == kVgaWidth) {
+      NewLine();
+    }
   }
 }
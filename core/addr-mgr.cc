@@ -3,6 +3,7 @@
 #include <arch.h>
 
 #include "core/macros.h"
+#include "core/object-cache.h"
 
 using Region = AddrMgr::Region;
 
@@ -12,16 +13,18 @@ struct AddrMgr::Region {
     return end - begin;
   }
 
-  AvlNode addr_node;
-  AvlNode size_node;
+  AvlNode node;
 
   uintptr_t begin = 0;
   uintptr_t end = 0;
+
+  // Largest `size()` in this region's subtree.
+  size_t max_size = 0;
 };
 
 int AddrMgr::CompareVa(AvlNode* lhs, AvlNode* rhs) {
-  Region* l = CONTAINER_OF(lhs, Region, addr_node);
-  Region* r = CONTAINER_OF(rhs, Region, addr_node);
+  Region* l = CONTAINER_OF(lhs, Region, node);
+  Region* r = CONTAINER_OF(rhs, Region, node);
 
   if (l->end <= r->begin) {
     return -1;
@@ -34,67 +37,73 @@ int AddrMgr::CompareVa(AvlNode* lhs, AvlNode* rhs) {
   return 0;
 }
 
-int AddrMgr::CompareSize(AvlNode* lhs, AvlNode* rhs) {
-  Region* l = CONTAINER_OF(lhs, Region, size_node);
-  Region* r = CONTAINER_OF(rhs, Region, size_node);
-
-  assert(l->size() >= PAGE_SIZE);
-  assert(r->size() >= PAGE_SIZE);
-
-  if (l->size() < r->size()) {
-    return -1;
-  }
+namespace {
 
-  if (l->size() > r->size()) {
-    return 1;
+size_t MaxSize(const AvlNode* t) {
+  if (t == nullptr) {
+    return 0;
   }
 
-  if (l->end <= r->begin) {
-    return -1;
-  }
+  const Region* r = CONTAINER_OF(t, Region, node);
+  return r->max_size;
+}
 
-  if (r->end <= l->begin) {
-    return 1;
-  }
+}  // namespace
 
-  return 0;
+void AddrMgr::UpdateMaxSize(AvlNode* node) {
+  Region* r = CONTAINER_OF(node, Region, node);
+  r->max_size =
+      std::max(r->size(), std::max(MaxSize(node->left), MaxSize(node->right)));
 }
 
 namespace {
 
-Region* FindRegion(const AvlNode* t, size_t size) {
-  if (t == nullptr) {
-    return nullptr;
+// Regions back virtual address allocation, so they can't come from the heap.
+// The boot slab is needed to register the kernel VAs in the first place.
+alignas(ObjectCache<Region>::kSlabSize) char
+    g_region_boot_slab[ObjectCache<Region>::kSlabSize];
+ObjectCache<Region> g_region_cache("region", /*reserve=*/4, nullptr,
+                                   g_region_boot_slab);
+
+// Where an allocation of `size` bytes aligned to `align` would start in `r`,
+// or 0 if it doesn't fit.
+uintptr_t AlignedFit(const Region* r, size_t size, size_t align) {
+  const uintptr_t begin = ROUND_UP_TO(r->begin, align);
+  if (begin < r->begin || begin >= r->end || r->end - begin < size) {
+    return 0;
   }
 
-  Region* r = CONTAINER_OF(t, Region, size_node);
+  return begin;
+}
 
-  // Exact size.
-  if (r->size() == size) {
-    return r;
+// Lowest addressed region in `t` with room for `size` bytes aligned to
+// `align`. Subtrees without a region of at least `size` bytes are skipped, so
+// without alignment this is a single descent. Aligned requests may visit
+// regions which are large enough but fit only once padded.
+Region* FindFirstFit(const AvlNode* t, size_t size, size_t align) {
+  if (MaxSize(t) < size) {
+    return nullptr;
   }
 
-  // Too small, check larger regions.
-  if (r->size() < size) {
-    return FindRegion(t->right, size);
+  Region* found = FindFirstFit(t->left, size, align);
+  if (found != nullptr) {
+    return found;
   }
 
-  // Bigger than needed, so try to find a smaller one.
-  Region* l_region = FindRegion(t->left, size);
-  if (l_region != nullptr) {
-    return l_region;
+  Region* r = CONTAINER_OF(t, Region, node);
+  if (AlignedFit(r, size, align) != 0) {
+    return r;
   }
 
-  return r;
+  return FindFirstFit(t->right, size, align);
 }
 
 }  // namespace
 
 AddrMgr::~AddrMgr() {
-  // Both trees point to the same nodes.
-  free_by_addr_.ForEachBottomUp([](AvlNode* node) {
-    Region* region = CONTAINER_OF(node, Region, addr_node);
-    delete region;
+  free_.ForEachBottomUp([](AvlNode* node) {
+    Region* region = CONTAINER_OF(node, Region, node);
+    g_region_cache.Free(region);
   });
 }
 
@@ -111,39 +120,66 @@ int AddrMgr::AddVas(uintptr_t va, size_t num_pages) {
     return -1;
   }
 
-  Region* region = new Region;
+  Region* region = g_region_cache.Alloc();
   if (region == nullptr) {
     return -1;
   }
   region->begin = begin;
   region->end = end;
 
-  InsertRegion(*region);
+  AvlNode* existing = free_.Insert(region->node);
+  assert(existing == nullptr);
   return 0;
 }
 
-uintptr_t AddrMgr::Alloc(size_t num_pages) {
-  size_t size = num_pages * PAGE_SIZE;
-  Region* region = FindRegion(free_by_size_.root(), size);
-  if (region == nullptr) {
+uintptr_t AddrMgr::Alloc(size_t num_pages, size_t align_pages) {
+  assert(align_pages > 0 && (align_pages & (align_pages - 1)) == 0);
+  if (num_pages == 0) {
     return 0;
   }
 
-  const uintptr_t ret = region->begin;
-  EraseRegion(*region);
+  const size_t size = num_pages * PAGE_SIZE;
+  const size_t align = align_pages * PAGE_SIZE;
 
-  // Update the region.
-  region->begin += size;
+  Region* region = FindFirstFit(free_.root(), size, align);
+  if (region == nullptr) {
+    return 0;
+  }
+
+  const uintptr_t ret = AlignedFit(region, size, align);
+  const uintptr_t alloc_end = ret + size;
 
   // Allocated whole region.
-  if (region->size() == 0) {
-    delete region;
+  if (region->begin == ret && region->end == alloc_end) {
+    free_.Remove(region->node);
+    g_region_cache.Free(region);
     return ret;
   }
 
-  // Store second half in free lists.
-  InsertRegion(*region);
+  // Shrinking a region keeps it in order, so it can be updated in place.
+  if (region->begin == ret) {
+    region->begin = alloc_end;
+    free_.Reaugment(region->node);
+    return ret;
+  }
 
+  if (region->end > alloc_end) {
+    Region* tail = g_region_cache.Alloc();
+    if (tail == nullptr) {
+      return 0;
+    }
+    tail->begin = alloc_end;
+    tail->end = region->end;
+
+    region->end = ret;
+    free_.Reaugment(region->node);
+    AvlNode* existing = free_.Insert(tail->node);
+    assert(existing == nullptr);
+    return ret;
+  }
+
+  region->end = ret;
+  free_.Reaugment(region->node);
   return ret;
 }
 
@@ -153,105 +189,75 @@ void AddrMgr::Free(uintptr_t addr, size_t num_pages) {
   }
 
   const uintptr_t begin = addr;
-  const uintptr_t end = num_pages * PAGE_SIZE;
-
-  {
-    AvlNode* existing = free_by_addr_.Find([&](AvlNode* node) {
-      Region* region = CONTAINER_OF(node, Region, addr_node);
-      if (end < region->begin) {
-        return -1;
-      }
-
-      if (begin > region->end) {
-        return 1;
-      }
-
-      return 0;
-    });
-    if (existing != nullptr) {
-      PANIC("%s: Double free of VA: [%p, %p)", __func__, (void*)begin,
-            (void*)end);
-    }
-  }
+  const uintptr_t end = begin + num_pages * PAGE_SIZE;
 
-  uintptr_t new_begin = begin;
-  uintptr_t new_end = end;
-  Region* new_region = nullptr;
-
-  // See if we can coalesce adjacent regions.
-  AvlNode* adjacent_left_node = free_by_addr_.Find([&](AvlNode* node) {
-    Region* region = CONTAINER_OF(node, Region, addr_node);
-    if (begin < region->end) {
+  // The first region not before the freed range, and the one preceding it.
+  auto it = free_.LowerBound([&](AvlNode* node) {
+    Region* region = CONTAINER_OF(node, Region, node);
+    if (end <= region->begin) {
       return -1;
     }
 
-    if (begin > region->end) {
+    if (begin >= region->end) {
       return 1;
     }
 
     return 0;
   });
 
-  Region* adjacent_left = nullptr;
-  if (adjacent_left_node) {
-    adjacent_left = CONTAINER_OF(adjacent_left_node, Region, addr_node);
-    new_begin = adjacent_left->begin;
-    EraseRegion(*adjacent_left);
+  Region* adjacent_right = nullptr;
+  if (it != free_.end()) {
+    Region* region = CONTAINER_OF(&*it, Region, node);
+    if (region->begin < end) {
+      PANIC("%s: Double free of VA: [%p, %p)", __func__, (void*)begin,
+            (void*)end);
+    }
 
-    new_region = adjacent_left;
+    if (region->begin == end) {
+      adjacent_right = region;
+    }
   }
 
-  AvlNode* adjacent_right_node = free_by_addr_.Find([&](AvlNode* node) {
-    Region* region = CONTAINER_OF(node, Region, addr_node);
-    if (end < region->begin) {
-      return -1;
+  Region* adjacent_left = nullptr;
+  if (it != free_.begin()) {
+    --it;
+    Region* region = CONTAINER_OF(&*it, Region, node);
+    assert(region->end <= begin);
+    if (region->end == begin) {
+      adjacent_left = region;
     }
+  }
 
-    if (end > region->begin) {
-      return 1;
+  // Growing a region into the freed gap keeps it in order, so neighbors are
+  // updated in place.
+  if (adjacent_left != nullptr) {
+    uintptr_t new_end = end;
+    if (adjacent_right != nullptr) {
+      new_end = adjacent_right->end;
+      free_.Remove(adjacent_right->node);
+      g_region_cache.Free(adjacent_right);
     }
 
-    return 0;
-  });
+    adjacent_left->end = new_end;
+    free_.Reaugment(adjacent_left->node);
+    return;
+  }
 
-  Region* adjacent_right = nullptr;
-  if (adjacent_right_node) {
-    new_end = adjacent_right->end;
-    EraseRegion(*adjacent_right);
-
-    if (new_region != nullptr) {
-      delete adjacent_right;
-    } else {
-      new_region = adjacent_right;
-    }
+  if (adjacent_right != nullptr) {
+    adjacent_right->begin = begin;
+    free_.Reaugment(adjacent_right->node);
+    return;
   }
 
+  Region* new_region = g_region_cache.Alloc();
   if (new_region == nullptr) {
-    new_region = new Region;
-    if (new_region == nullptr) {
-      // TODO(bcf): Handle this robustly.
-      LOG("%s: Failed to allocate new free region");
-      return;
-    }
+    // TODO(bcf): Handle this robustly.
+    LOG("%s: Failed to allocate new free region\n", __func__);
+    return;
   }
 
-  new_region->begin = new_begin;
-  new_region->end = new_end;
-  InsertRegion(*new_region);
-}
-
-void AddrMgr::InsertRegion(Region& region) {
-  AvlNode* existing = free_by_addr_.Insert(region.addr_node);
+  new_region->begin = begin;
+  new_region->end = end;
+  AvlNode* existing = free_.Insert(new_region->node);
   assert(existing == nullptr);
-
-  existing = free_by_size_.Insert(region.size_node);
-  assert(existing == nullptr);
-}
-
-void AddrMgr::EraseRegion(Region& region) {
-  AvlNode* deleted = free_by_size_.Erase(region.size_node);
-  assert(deleted == &region.size_node);
-
-  deleted = free_by_addr_.Erase(region.addr_node);
-  assert(deleted == &region.addr_node);
 }
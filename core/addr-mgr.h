@@ -16,18 +16,18 @@ class AddrMgr {
 
   // TODO(bcf): Introduce status type.
   int AddVas(uintptr_t va, size_t num_pages);
-  uintptr_t Alloc(size_t num_pages);
+  // Returns the lowest free address aligned to `align_pages`, which must be a
+  // power of two. Returns 0 on failure.
+  uintptr_t Alloc(size_t num_pages, size_t align_pages = 1);
   void Free(uintptr_t addr, size_t num_pages);
 
   struct Region;
 
  private:
   static int CompareVa(AvlNode* lhs, AvlNode* rhs);
-  static int CompareSize(AvlNode* lhs, AvlNode* rhs);
+  static void UpdateMaxSize(AvlNode* node);
 
-  void InsertRegion(Region& region);
-  void EraseRegion(Region& region);
-
-  IntrusiveAvlTree<CompareSize> free_by_size_;
-  IntrusiveAvlTree<CompareVa> free_by_addr_;
+  // Free regions by address. Each node also tracks the largest region in its
+  // subtree, so first fit is a single descent.
+  IntrusiveAvlTree<CompareVa, UpdateMaxSize> free_;
 };
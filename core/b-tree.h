@@ -0,0 +1,585 @@
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "core/object-cache.h"
+#include "core/types.h"
+
+// Ordered map from `K` to `V`, as a B+ tree.
+//
+// Each node keeps its keys in one contiguous array and is sized to two cache
+// lines, so a lookup scans a line or two per level instead of missing on every
+// node of a binary tree. Entries live in the leaves, which are linked in key
+// order for iteration. Nodes come from object caches owned by the tree.
+//
+// `K` and `V` must be trivially copyable and `K` ordered by `<`.
+template <typename K, typename V>
+class BTree {
+  struct Node;
+  struct Leaf;
+  struct Inner;
+
+ public:
+  class iterator {
+   public:
+    iterator(const BTree* tree, Leaf* leaf, int idx)
+        : tree_(tree), leaf_(leaf), idx_(idx) {}
+
+    const K& key() const { return leaf_->keys[idx_]; }
+    V& value() const { return leaf_->values[idx_]; }
+
+    iterator& operator++() {
+      if (++idx_ == leaf_->num_keys) {
+        leaf_ = leaf_->next;
+        idx_ = 0;
+      }
+      return *this;
+    }
+
+    // Decrementing `end()` gives the last entry. The tree must not be empty.
+    iterator& operator--() {
+      if (leaf_ == nullptr) {
+        assert(tree_->last_ != nullptr);
+        leaf_ = tree_->last_;
+        idx_ = leaf_->num_keys;
+      } else if (idx_ == 0) {
+        leaf_ = leaf_->prev;
+        idx_ = leaf_->num_keys;
+      }
+      --idx_;
+      return *this;
+    }
+
+    bool operator==(const iterator& other) const {
+      return leaf_ == other.leaf_ && idx_ == other.idx_;
+    }
+    bool operator!=(const iterator& other) const { return !(*this == other); }
+
+   private:
+    friend class BTree;
+
+    const BTree* tree_;
+    Leaf* leaf_;
+    int idx_;
+  };
+
+  explicit BTree(const char* name)
+      : leaf_cache_(name, /*reserve=*/0), inner_cache_(name, /*reserve=*/0) {}
+  ~BTree() { Clear(); }
+
+  BTree(const BTree&) = delete;
+  BTree& operator=(const BTree&) = delete;
+
+  // `key` must not be in the tree. Returns -1 if out of memory.
+  int Insert(const K& key, const V& value) {
+    if (root_ == nullptr && NewRoot() < 0) {
+      return -1;
+    }
+
+    Leaf* leaf = FindLeaf(key);
+    int idx = LowerIdx(leaf->keys, leaf->num_keys, key);
+    assert(idx == leaf->num_keys || key < leaf->keys[idx]);
+
+    if (leaf->num_keys == kLeafSlots) {
+      Spares spares;
+      if (ReserveSpares(leaf, &spares) < 0) {
+        return -1;
+      }
+
+      Leaf* right = SplitLeaf(leaf, leaf->num_keys / 2, &spares);
+      if (idx > leaf->num_keys) {
+        idx -= leaf->num_keys;
+        leaf = right;
+      }
+    }
+
+    InsertInLeaf(leaf, idx, key, value);
+    return 0;
+  }
+
+  // Returns false if `key` isn't in the tree.
+  bool Erase(const K& key) {
+    iterator it = Find(key);
+    if (it == end()) {
+      return false;
+    }
+
+    Erase(it);
+    return true;
+  }
+
+  // Invalidates all iterators.
+  void Erase(iterator it) {
+    Leaf* leaf = it.leaf_;
+    for (int i = it.idx_ + 1; i < leaf->num_keys; ++i) {
+      leaf->keys[i - 1] = leaf->keys[i];
+      leaf->values[i - 1] = leaf->values[i];
+    }
+    --leaf->num_keys;
+    --size_;
+
+    if (leaf == root_) {
+      if (leaf->num_keys == 0) {
+        leaf_cache_.Free(leaf);
+        root_ = nullptr;
+        first_ = nullptr;
+        last_ = nullptr;
+      }
+      return;
+    }
+
+    if (leaf->num_keys < kMinLeafKeys) {
+      FixLeaf(leaf);
+    }
+  }
+
+  void Clear() {
+    while (root_ != nullptr) {
+      Erase(begin());
+    }
+  }
+
+  iterator Find(const K& key) const {
+    iterator it = LowerBound(key);
+    if (it == end() || key < it.key()) {
+      return end();
+    }
+    return it;
+  }
+
+  // First entry whose key isn't less than `key`.
+  iterator LowerBound(const K& key) const {
+    if (root_ == nullptr) {
+      return end();
+    }
+
+    Leaf* leaf = FindLeaf(key);
+    return MakeIterator(leaf, LowerIdx(leaf->keys, leaf->num_keys, key));
+  }
+
+  // First entry whose key is greater than `key`.
+  iterator UpperBound(const K& key) const {
+    if (root_ == nullptr) {
+      return end();
+    }
+
+    Leaf* leaf = FindLeaf(key);
+    return MakeIterator(leaf, UpperIdx(leaf->keys, leaf->num_keys, key));
+  }
+
+  iterator begin() const { return iterator(this, first_, 0); }
+  iterator end() const { return iterator(this, nullptr, 0); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+ private:
+  // Two cache lines.
+  static constexpr size_t kNodeBytes = 128;
+  static constexpr size_t kHeaderBytes = sizeof(Inner*) + sizeof(int) * 2;
+  static constexpr int kLeafSlots =
+      (kNodeBytes - kHeaderBytes - 2 * sizeof(Leaf*)) / (sizeof(K) + sizeof(V));
+  static constexpr int kInnerSlots =
+      (kNodeBytes - kHeaderBytes - sizeof(Node*)) / (sizeof(K) + sizeof(Node*));
+  static_assert(kLeafSlots >= 4 && kInnerSlots >= 4, "Entries too large");
+
+  // Nodes other than the root are merged or refilled below this.
+  static constexpr int kMinLeafKeys = kLeafSlots / 2;
+  static constexpr int kMinInnerKeys = kInnerSlots / 2;
+
+  // Enough for any tree that fits in the address space.
+  static constexpr int kMaxHeight = 16;
+
+  struct Node {
+    Inner* parent = nullptr;
+    int num_keys = 0;
+    bool is_leaf = false;
+  };
+
+  struct alignas(64) Leaf : Node {
+    Leaf() { this->is_leaf = true; }
+
+    Leaf* prev = nullptr;
+    Leaf* next = nullptr;
+    K keys[kLeafSlots];
+    V values[kLeafSlots];
+  };
+
+  // `children[i]` holds the keys in `[keys[i - 1], keys[i])`.
+  struct alignas(64) Inner : Node {
+    K keys[kInnerSlots];
+    Node* children[kInnerSlots + 1];
+  };
+
+  static_assert(sizeof(Leaf) == kNodeBytes && sizeof(Inner) == kNodeBytes);
+
+  // Nodes allocated up front so splitting can't fail halfway.
+  struct Spares {
+    Leaf* leaf = nullptr;
+    Inner* inners[kMaxHeight];
+    int num_inners = 0;
+  };
+
+  static int LowerIdx(const K* keys, int num_keys, const K& key) {
+    int i = 0;
+    while (i < num_keys && keys[i] < key) {
+      ++i;
+    }
+    return i;
+  }
+
+  static int UpperIdx(const K* keys, int num_keys, const K& key) {
+    int i = 0;
+    while (i < num_keys && !(key < keys[i])) {
+      ++i;
+    }
+    return i;
+  }
+
+  static int ChildIdx(const Inner* parent, const Node* child) {
+    int i = 0;
+    while (parent->children[i] != child) {
+      ++i;
+      assert(i <= parent->num_keys);
+    }
+    return i;
+  }
+
+  iterator MakeIterator(Leaf* leaf, int idx) const {
+    if (idx == leaf->num_keys) {
+      return iterator(this, leaf->next, 0);
+    }
+    return iterator(this, leaf, idx);
+  }
+
+  Leaf* FindLeaf(const K& key) const {
+    Node* node = root_;
+    while (!node->is_leaf) {
+      auto* inner = static_cast<Inner*>(node);
+      node = inner->children[UpperIdx(inner->keys, inner->num_keys, key)];
+    }
+    return static_cast<Leaf*>(node);
+  }
+
+  int NewRoot() {
+    Leaf* leaf = leaf_cache_.Alloc();
+    if (leaf == nullptr) {
+      return -1;
+    }
+
+    root_ = leaf;
+    first_ = leaf;
+    last_ = leaf;
+    return 0;
+  }
+
+  void InsertInLeaf(Leaf* leaf, int idx, const K& key, const V& value) {
+    assert(leaf->num_keys < kLeafSlots);
+    for (int i = leaf->num_keys; i > idx; --i) {
+      leaf->keys[i] = leaf->keys[i - 1];
+      leaf->values[i] = leaf->values[i - 1];
+    }
+    leaf->keys[idx] = key;
+    leaf->values[idx] = value;
+    ++leaf->num_keys;
+    ++size_;
+  }
+
+  // Allocates the nodes needed to split the full `leaf`: the new leaf, one
+  // inner node per full ancestor and possibly a new root.
+  int ReserveSpares(Leaf* leaf, Spares* spares) {
+    int num_inners = 0;
+    Inner* parent = leaf->parent;
+    while (parent != nullptr && parent->num_keys == kInnerSlots) {
+      ++num_inners;
+      parent = parent->parent;
+    }
+    if (parent == nullptr) {
+      ++num_inners;
+    }
+    assert(num_inners <= kMaxHeight);
+
+    spares->leaf = leaf_cache_.Alloc();
+    if (spares->leaf == nullptr) {
+      return -1;
+    }
+
+    for (int i = 0; i < num_inners; ++i) {
+      Inner* inner = inner_cache_.Alloc();
+      if (inner == nullptr) {
+        leaf_cache_.Free(spares->leaf);
+        while (spares->num_inners > 0) {
+          inner_cache_.Free(spares->inners[--spares->num_inners]);
+        }
+        return -1;
+      }
+      spares->inners[spares->num_inners++] = inner;
+    }
+
+    return 0;
+  }
+
+  // Moves the entries of `leaf` from `split_at` on into a new leaf to its
+  // right.
+  Leaf* SplitLeaf(Leaf* leaf, int split_at, Spares* spares) {
+    Leaf* right = spares->leaf;
+    for (int i = split_at; i < leaf->num_keys; ++i) {
+      right->keys[i - split_at] = leaf->keys[i];
+      right->values[i - split_at] = leaf->values[i];
+    }
+    right->num_keys = leaf->num_keys - split_at;
+    leaf->num_keys = split_at;
+
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next != nullptr) {
+      leaf->next->prev = right;
+    } else {
+      last_ = right;
+    }
+    leaf->next = right;
+
+    InsertChild(leaf, right->keys[0], right, spares);
+    return right;
+  }
+
+  // Adds `right` to the right of `left` in its parent, splitting full
+  // ancestors on the way up.
+  void InsertChild(Node* left, K sep, Node* right, Spares* spares) {
+    while (true) {
+      Inner* parent = left->parent;
+      if (parent == nullptr) {
+        Inner* root = spares->inners[--spares->num_inners];
+        root->keys[0] = sep;
+        root->children[0] = left;
+        root->children[1] = right;
+        root->num_keys = 1;
+        left->parent = root;
+        right->parent = root;
+        root_ = root;
+        break;
+      }
+
+      const int pos = ChildIdx(parent, left);
+      if (parent->num_keys < kInnerSlots) {
+        for (int i = parent->num_keys; i > pos; --i) {
+          parent->keys[i] = parent->keys[i - 1];
+          parent->children[i + 1] = parent->children[i];
+        }
+        parent->keys[pos] = sep;
+        parent->children[pos + 1] = right;
+        ++parent->num_keys;
+        right->parent = parent;
+        break;
+      }
+
+      // Lay out the overfull node, then give its upper half to a new node.
+      K keys[kInnerSlots + 1];
+      Node* children[kInnerSlots + 2];
+      for (int i = 0, j = 0; i <= kInnerSlots; ++i) {
+        if (i == pos) {
+          keys[j++] = sep;
+        }
+        if (i < kInnerSlots) {
+          keys[j++] = parent->keys[i];
+        }
+      }
+      for (int i = 0, j = 0; i <= kInnerSlots; ++i) {
+        children[j++] = parent->children[i];
+        if (i == pos) {
+          children[j++] = right;
+        }
+      }
+
+      Inner* sibling = spares->inners[--spares->num_inners];
+      const int mid = (kInnerSlots + 1) / 2;
+      parent->num_keys = mid;
+      for (int i = 0; i < mid; ++i) {
+        parent->keys[i] = keys[i];
+        parent->children[i] = children[i];
+        children[i]->parent = parent;
+      }
+      parent->children[mid] = children[mid];
+      children[mid]->parent = parent;
+
+      sibling->num_keys = kInnerSlots - mid;
+      for (int i = 0; i < sibling->num_keys; ++i) {
+        sibling->keys[i] = keys[mid + 1 + i];
+        sibling->children[i] = children[mid + 1 + i];
+        children[mid + 1 + i]->parent = sibling;
+      }
+      sibling->children[sibling->num_keys] = children[kInnerSlots + 1];
+      children[kInnerSlots + 1]->parent = sibling;
+
+      left = parent;
+      sep = keys[mid];
+      right = sibling;
+    }
+
+    assert(spares->num_inners == 0);
+  }
+
+  // Drops `keys[idx]` and `children[idx + 1]`.
+  static void RemoveChild(Inner* inner, int idx) {
+    for (int i = idx + 1; i < inner->num_keys; ++i) {
+      inner->keys[i - 1] = inner->keys[i];
+      inner->children[i] = inner->children[i + 1];
+    }
+    --inner->num_keys;
+  }
+
+  // Refills the underfull `leaf` from a sibling or merges it into one.
+  void FixLeaf(Leaf* leaf) {
+    Inner* parent = leaf->parent;
+    const int idx = ChildIdx(parent, leaf);
+    auto* left =
+        idx > 0 ? static_cast<Leaf*>(parent->children[idx - 1]) : nullptr;
+    auto* right = idx < parent->num_keys
+                      ? static_cast<Leaf*>(parent->children[idx + 1])
+                      : nullptr;
+
+    if (left != nullptr && left->num_keys > kMinLeafKeys) {
+      for (int i = leaf->num_keys; i > 0; --i) {
+        leaf->keys[i] = leaf->keys[i - 1];
+        leaf->values[i] = leaf->values[i - 1];
+      }
+      --left->num_keys;
+      leaf->keys[0] = left->keys[left->num_keys];
+      leaf->values[0] = left->values[left->num_keys];
+      ++leaf->num_keys;
+      parent->keys[idx - 1] = leaf->keys[0];
+      return;
+    }
+
+    if (right != nullptr && right->num_keys > kMinLeafKeys) {
+      leaf->keys[leaf->num_keys] = right->keys[0];
+      leaf->values[leaf->num_keys] = right->values[0];
+      ++leaf->num_keys;
+      for (int i = 1; i < right->num_keys; ++i) {
+        right->keys[i - 1] = right->keys[i];
+        right->values[i - 1] = right->values[i];
+      }
+      --right->num_keys;
+      parent->keys[idx] = right->keys[0];
+      return;
+    }
+
+    // Merge the right one of the pair into the left.
+    int sep_idx = idx;
+    if (left != nullptr) {
+      right = leaf;
+      sep_idx = idx - 1;
+    } else {
+      left = leaf;
+    }
+
+    for (int i = 0; i < right->num_keys; ++i) {
+      left->keys[left->num_keys + i] = right->keys[i];
+      left->values[left->num_keys + i] = right->values[i];
+    }
+    left->num_keys += right->num_keys;
+
+    left->next = right->next;
+    if (right->next != nullptr) {
+      right->next->prev = left;
+    } else {
+      last_ = left;
+    }
+    leaf_cache_.Free(right);
+
+    RemoveChild(parent, sep_idx);
+    FixInner(parent);
+  }
+
+  // Like `FixLeaf`, repeated up the tree while merges leave parents underfull.
+  void FixInner(Inner* node) {
+    while (true) {
+      if (node == root_) {
+        if (node->num_keys == 0) {
+          root_ = node->children[0];
+          root_->parent = nullptr;
+          inner_cache_.Free(node);
+        }
+        return;
+      }
+
+      if (node->num_keys >= kMinInnerKeys) {
+        return;
+      }
+
+      Inner* parent = node->parent;
+      const int idx = ChildIdx(parent, node);
+      auto* left =
+          idx > 0 ? static_cast<Inner*>(parent->children[idx - 1]) : nullptr;
+      auto* right = idx < parent->num_keys
+                        ? static_cast<Inner*>(parent->children[idx + 1])
+                        : nullptr;
+
+      if (left != nullptr && left->num_keys > kMinInnerKeys) {
+        node->children[node->num_keys + 1] = node->children[node->num_keys];
+        for (int i = node->num_keys; i > 0; --i) {
+          node->keys[i] = node->keys[i - 1];
+          node->children[i] = node->children[i - 1];
+        }
+        node->keys[0] = parent->keys[idx - 1];
+        node->children[0] = left->children[left->num_keys];
+        node->children[0]->parent = node;
+        ++node->num_keys;
+
+        parent->keys[idx - 1] = left->keys[left->num_keys - 1];
+        --left->num_keys;
+        return;
+      }
+
+      if (right != nullptr && right->num_keys > kMinInnerKeys) {
+        node->keys[node->num_keys] = parent->keys[idx];
+        node->children[node->num_keys + 1] = right->children[0];
+        node->children[node->num_keys + 1]->parent = node;
+        ++node->num_keys;
+
+        parent->keys[idx] = right->keys[0];
+        for (int i = 1; i < right->num_keys; ++i) {
+          right->keys[i - 1] = right->keys[i];
+          right->children[i - 1] = right->children[i];
+        }
+        right->children[right->num_keys - 1] =
+            right->children[right->num_keys];
+        --right->num_keys;
+        return;
+      }
+
+      // Merge the right one of the pair and their separator into the left.
+      int sep_idx = idx;
+      if (left != nullptr) {
+        right = node;
+        sep_idx = idx - 1;
+      } else {
+        left = node;
+      }
+
+      left->keys[left->num_keys] = parent->keys[sep_idx];
+      for (int i = 0; i < right->num_keys; ++i) {
+        left->keys[left->num_keys + 1 + i] = right->keys[i];
+      }
+      for (int i = 0; i <= right->num_keys; ++i) {
+        left->children[left->num_keys + 1 + i] = right->children[i];
+        right->children[i]->parent = left;
+      }
+      left->num_keys += 1 + right->num_keys;
+      inner_cache_.Free(right);
+
+      RemoveChild(parent, sep_idx);
+      node = parent;
+    }
+  }
+
+  ObjectCache<Leaf> leaf_cache_;
+  ObjectCache<Inner> inner_cache_;
+
+  Node* root_ = nullptr;
+  // Ends of the leaf list.
+  Leaf* first_ = nullptr;
+  Leaf* last_ = nullptr;
+  size_t size_ = 0;
+};
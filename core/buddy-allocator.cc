@@ -0,0 +1,148 @@
+#include "core/buddy-allocator.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "core/macros.h"
+#include "libc/macros.h"
+
+namespace {
+
+// Smallest order with `2^order >= num_frames`.
+int CeilOrder(size_t num_frames) {
+  assert(num_frames > 0);
+  if (num_frames == 1) {
+    return 0;
+  }
+
+  return sizeof(unsigned) * 8 - __builtin_clz(num_frames - 1);
+}
+
+// Largest order with `2^order <= num_frames`.
+int FloorOrder(size_t num_frames) {
+  assert(num_frames > 0);
+  return sizeof(unsigned) * 8 - 1 - __builtin_clz(num_frames);
+}
+
+size_t FreeMapWords(size_t num_frames) { return DIV_ROUND_UP(num_frames, 32); }
+
+}  // namespace
+
+size_t BuddyAllocator::MetadataSize(size_t num_frames) {
+  return FreeMapWords(num_frames) * sizeof(u32);
+}
+
+void BuddyAllocator::Init(Pages* frames, void* mem, size_t num_frames) {
+  assert(frames_ == nullptr);
+
+  frames_ = frames;
+  free_map_ = reinterpret_cast<u32*>(mem);
+  memset(free_map_, 0, FreeMapWords(num_frames) * sizeof(u32));
+
+  num_frames_ = num_frames;
+}
+
+size_t BuddyAllocator::Alloc(const size_t num_frames) {
+  if (num_frames == 0) {
+    return kInvalidPfn;
+  }
+
+  const int order = CeilOrder(num_frames);
+  if (order > kMaxOrder) {
+    return kInvalidPfn;
+  }
+
+  // Smallest non-empty order that is large enough.
+  const u32 candidates = nonempty_orders_ & ~((1u << order) - 1);
+  if (candidates == 0) {
+    return kInvalidPfn;
+  }
+  int cur_order = __builtin_ctz(candidates);
+
+  const size_t pfn = PopBlock(cur_order);
+
+  // Split the block, returning the upper halves.
+  while (cur_order > order) {
+    --cur_order;
+    PushBlock(pfn + (size_t{1} << cur_order), cur_order);
+  }
+
+  // Return the unused tail of the block.
+  const size_t block_frames = size_t{1} << order;
+  if (block_frames > num_frames) {
+    Free(pfn + num_frames, block_frames - num_frames);
+  }
+
+  return pfn;
+}
+
+void BuddyAllocator::Free(size_t pfn, size_t num_frames) {
+  assert(pfn + num_frames <= num_frames_);
+
+  // Split the range into naturally aligned blocks.
+  while (num_frames > 0) {
+    int order = FloorOrder(num_frames);
+    if (pfn != 0) {
+      order = std::min(order, __builtin_ctz(pfn));
+    }
+    order = std::min(order, kMaxOrder);
+
+    FreeBlock(pfn, order);
+
+    pfn += size_t{1} << order;
+    num_frames -= size_t{1} << order;
+  }
+}
+
+void BuddyAllocator::PushBlock(size_t pfn, int order) {
+  assert(!IsFreeHead(pfn));
+
+  Pages& frame = frames_[pfn];
+  frame.order = order;
+  free_lists_[order].push_front(frame.link);
+  free_map_[pfn / 32] |= 1u << (pfn % 32);
+  nonempty_orders_ |= 1u << order;
+  num_free_ += size_t{1} << order;
+}
+
+void BuddyAllocator::EraseBlock(size_t pfn, int order) {
+  assert(IsFreeHead(pfn));
+
+  Pages& frame = frames_[pfn];
+  assert(frame.order == order);
+  free_lists_[order].erase(frame.link);
+  free_map_[pfn / 32] &= ~(1u << (pfn % 32));
+  if (free_lists_[order].empty()) {
+    nonempty_orders_ &= ~(1u << order);
+  }
+  num_free_ -= size_t{1} << order;
+}
+
+size_t BuddyAllocator::PopBlock(int order) {
+  assert(!free_lists_[order].empty());
+
+  Pages* frame = CONTAINER_OF(&*free_lists_[order].begin(), Pages, link);
+  const size_t pfn = frame - frames_;
+  EraseBlock(pfn, order);
+  return pfn;
+}
+
+void BuddyAllocator::FreeBlock(size_t pfn, int order) {
+  PANIC_IF(IsFreeHead(pfn), "%s: Double free of pfn: %x\n", __func__, pfn);
+
+  // Merge with free buddies for as long as possible.
+  while (order < kMaxOrder) {
+    const size_t buddy = pfn ^ (size_t{1} << order);
+    if (buddy >= num_frames_ || !IsFreeHead(buddy) ||
+        frames_[buddy].order != order) {
+      break;
+    }
+
+    EraseBlock(buddy, order);
+    pfn &= ~(size_t{1} << order);
+    ++order;
+  }
+
+  PushBlock(pfn, order);
+}
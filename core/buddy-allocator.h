@@ -0,0 +1,62 @@
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "core/mm.h"
+#include "core/types.h"
+#include "libc/intrusive-list.h"
+
+// Binary buddy allocator over page frame numbers.
+//
+// Free blocks of `2^order` frames are kept on per-order free lists, and a
+// bitmap marks the frames which head a free block. Freeing a block checks its
+// buddy in the bitmap, so merging is constant time per order. Free lists are
+// linked through the frames' `Pages` descriptors and the bitmap lives in caller
+// provided memory, so allocating and freeing never touch the heap.
+class BuddyAllocator {
+ public:
+  // Largest block is `2^kMaxOrder` pages.
+  static constexpr int kMaxOrder = 10;
+  static constexpr size_t kInvalidPfn = static_cast<size_t>(-1);
+
+  BuddyAllocator() = default;
+
+  BuddyAllocator(const BuddyAllocator&) = delete;
+  BuddyAllocator& operator=(const BuddyAllocator&) = delete;
+
+  // Bytes of bookkeeping needed to manage frames `[0, num_frames)`.
+  static size_t MetadataSize(size_t num_frames);
+
+  // `frames` are the descriptors of frames `[0, num_frames)`. `mem` must be at
+  // least `MetadataSize(num_frames)` bytes. All frames start out allocated. Use
+  // `Free` to make them available.
+  void Init(Pages* frames, void* mem, size_t num_frames);
+
+  // Returns `kInvalidPfn` on failure. `num_frames` need not be a power of two,
+  // the tail of the block is returned to the free lists.
+  size_t Alloc(size_t num_frames);
+  void Free(size_t pfn, size_t num_frames);
+
+  size_t num_frames() const { return num_frames_; }
+  size_t num_free() const { return num_free_; }
+
+ private:
+  bool IsFreeHead(size_t pfn) const {
+    return (free_map_[pfn / 32] >> (pfn % 32)) & 1;
+  }
+
+  void PushBlock(size_t pfn, int order);
+  void EraseBlock(size_t pfn, int order);
+  size_t PopBlock(int order);
+  void FreeBlock(size_t pfn, int order);
+
+  Pages* frames_ = nullptr;
+  u32* free_map_ = nullptr;
+  size_t num_frames_ = 0;
+  size_t num_free_ = 0;
+
+  // Bit `i` is set when `free_lists_[i]` is non-empty.
+  u32 nonempty_orders_ = 0;
+  IntrusiveList free_lists_[kMaxOrder + 1];
+};
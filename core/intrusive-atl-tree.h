@@ -10,6 +10,7 @@
 struct AvlNode {
   AvlNode* left = nullptr;
   AvlNode* right = nullptr;
+  AvlNode* parent = nullptr;
   int height = 1;
 
   static int Height(const AvlNode* node) {
@@ -19,6 +20,10 @@ struct AvlNode {
   void CalcHeight() { height = std::max(Height(left), Height(right)) + 1; }
 
   int BalanceFactor() const { return Height(left) - Height(right); }
+
+  // In-order neighbors, nullptr past either end.
+  AvlNode* Next() const;
+  AvlNode* Prev() const;
 };
 
 // - Returns -1 if l < r
@@ -26,164 +31,184 @@ struct AvlNode {
 // - Returns  0 if l == r
 using AvlNodeCmp = int (*)(AvlNode* l, AvlNode* r);
 
+// Recomputes a per-subtree aggregate of `node` from its own data and its
+// children's aggregates. The tree calls it bottom up whenever a subtree
+// changes shape, including through rotations.
+using AvlNodeAugment = void (*)(AvlNode* node);
+
 namespace internal {
 
-inline void RotateRight(AvlNode*& node) {
+inline AvlNode* Leftmost(AvlNode* node) {
+  while (node->left != nullptr) {
+    node = node->left;
+  }
+  return node;
+}
+
+inline AvlNode* Rightmost(AvlNode* node) {
+  while (node->right != nullptr) {
+    node = node->right;
+  }
+  return node;
+}
+
+// First node visited by a post-order walk of `node`'s subtree.
+inline AvlNode* FirstPostOrder(AvlNode* node) {
+  while (true) {
+    if (node->left != nullptr) {
+      node = node->left;
+    } else if (node->right != nullptr) {
+      node = node->right;
+    } else {
+      return node;
+    }
+  }
+}
+
+template <AvlNodeAugment augment>
+void Update(AvlNode* node) {
+  node->CalcHeight();
+  if constexpr (augment != nullptr) {
+    augment(node);
+  }
+}
+
+// `link` is the pointer to `node` in its parent, or the root pointer.
+template <AvlNodeAugment augment>
+void RotateRight(AvlNode* node, AvlNode*& link) {
   AvlNode* new_root = node->left;
   AvlNode* rotated = new_root->right;
 
   new_root->right = node;
+  new_root->parent = node->parent;
   node->left = rotated;
+  node->parent = new_root;
+  if (rotated != nullptr) {
+    rotated->parent = node;
+  }
+  link = new_root;
 
-  node->CalcHeight();
-  new_root->CalcHeight();
-
-  node = new_root;
+  Update<augment>(node);
+  Update<augment>(new_root);
 }
 
-inline void RotateLeft(AvlNode*& node) {
+template <AvlNodeAugment augment>
+void RotateLeft(AvlNode* node, AvlNode*& link) {
   AvlNode* new_root = node->right;
   AvlNode* rotated = new_root->left;
 
   new_root->left = node;
+  new_root->parent = node->parent;
   node->right = rotated;
-
-  node->CalcHeight();
-  new_root->CalcHeight();
-
-  node = new_root;
-}
-
-template <AvlNodeCmp compare>
-AvlNode* Insert(AvlNode*& t, AvlNode* node) {
-  if (t != nullptr) {
-    assert(t->BalanceFactor() <= 1);
-    assert(t->BalanceFactor() >= -1);
+  node->parent = new_root;
+  if (rotated != nullptr) {
+    rotated->parent = node;
   }
+  link = new_root;
 
-  if (t == nullptr) {
-    node->left = nullptr;
-    node->right = nullptr;
-    node->height = 1;
-    t = node;
-    return nullptr;
-  }
-
-  int cmp = compare(node, t);
-  if (cmp == 0) {
-    return t;
-  }
-
-  AvlNode* duplicate = nullptr;
-  if (cmp < 0) {
-    duplicate = Insert<compare>(t->left, node);
-  } else {
-    assert(cmp > 0);
-    duplicate = Insert<compare>(t->right, node);
-  }
-  if (duplicate != nullptr) {
-    return duplicate;
-  }
+  Update<augment>(node);
+  Update<augment>(new_root);
+}
 
-  t->CalcHeight();
+template <AvlNodeAugment augment>
+void Rebalance(AvlNode* t, AvlNode*& link) {
+  Update<augment>(t);
 
   int balance = t->BalanceFactor();
   if (balance > 1) {
-    if (compare(node, t->left) < 0) {  // Left-Left
-      RotateRight(t);
-    } else {  // Left-Right
-      RotateLeft(t->left);
-      RotateRight(t);
+    if (t->left->BalanceFactor() < 0) {  // Left-Right
+      RotateLeft<augment>(t->left, t->left);
     }
+    RotateRight<augment>(t, link);
   } else if (balance < -1) {
-    if (compare(node, t->right) > 0) {  // Right-Right
-      RotateLeft(t);
-    } else {  // Right-Left
-      RotateRight(t->right);
-      RotateLeft(t);
+    if (t->right->BalanceFactor() > 0) {  // Right-Left
+      RotateRight<augment>(t->right, t->right);
     }
+    RotateLeft<augment>(t, link);
   }
-
-  return nullptr;
 }
 
-template <AvlNodeCmp compare>
-AvlNode* Erase(AvlNode*& t, AvlNode* key) {
-  if (t == nullptr) {
-    return nullptr;
+// Returns the first node `func` doesn't place the key after, or with `strict`,
+// the first node the key is before.
+template <typename Func>
+AvlNode* Bound(AvlNode* t, Func func, bool strict) {
+  AvlNode* bound = nullptr;
+  while (t != nullptr) {
+    int cmp = func(t);
+    if (cmp < 0 || (cmp == 0 && !strict)) {
+      bound = t;
+      t = t->left;
+    } else {
+      t = t->right;
+    }
   }
 
-  assert(t->BalanceFactor() <= 1);
-  assert(t->BalanceFactor() >= -1);
+  return bound;
+}
 
-  AvlNode* deleted = nullptr;
-  int cmp = compare(key, t);
-  if (cmp == 0) {
-    deleted = t;
-    t = nullptr;
-    return deleted;
-  }
+}  // namespace internal
 
-  if (cmp < 0) {
-    deleted = Erase<compare>(t->left, key);
-  } else {
-    deleted = Erase<compare>(t->right, key);
+inline AvlNode* AvlNode::Next() const {
+  if (right != nullptr) {
+    return internal::Leftmost(right);
   }
 
-  t->CalcHeight();
-
-  int balance = t->BalanceFactor();
-  if (balance > 1) {
-    if (t->left->BalanceFactor() > 1) {  // Left-Left
-      RotateRight(t);
-    } else {  // Left-Right
-      RotateLeft(t->left);
-      RotateRight(t);
-    }
-  } else if (balance < -1) {
-    if (t->right->BalanceFactor() < -1) {  // Right-Right
-      RotateLeft(t);
-    } else {  // Right-Left
-      RotateRight(t->right);
-      RotateLeft(t);
-    }
+  const AvlNode* node = this;
+  while (node->parent != nullptr && node->parent->right == node) {
+    node = node->parent;
   }
-
-  return deleted;
+  return node->parent;
 }
 
-template <typename Func>
-void ForEachBottomUp(AvlNode* t, Func func) {
-  if (t == nullptr) {
-    return;
+inline AvlNode* AvlNode::Prev() const {
+  if (left != nullptr) {
+    return internal::Rightmost(left);
   }
 
-  ForEachBottomUp(t->left, func);
-  ForEachBottomUp(t->right, func);
-  func(t);
+  const AvlNode* node = this;
+  while (node->parent != nullptr && node->parent->left == node) {
+    node = node->parent;
+  }
+  return node->parent;
 }
 
-template <typename Func>
-AvlNode* Find(AvlNode* t, Func func) {
-  if (t == nullptr) {
-    return nullptr;
-  }
+// Nodes point at their parent, so every operation is a loop and stack usage
+// doesn't grow with the tree. Iterators visit nodes in order.
+template <AvlNodeCmp compare, AvlNodeAugment augment = nullptr>
+class IntrusiveAvlTree {
+ public:
+  class iterator {
+   public:
+    iterator(IntrusiveAvlTree* tree, AvlNode* node)
+        : tree_(tree), node_(node) {}
+
+    iterator& operator++() {
+      node_ = node_->Next();
+      return *this;
+    }
 
-  int cmp = func(t);
-  if (cmp < 0) {
-    return Find(t->left, func);
-  } else if (cmp > 0) {
-    return Find(t->right, func);
-  }
+    // Decrementing `end()` gives the last node.
+    iterator& operator--() {
+      node_ = node_ == nullptr ? internal::Rightmost(tree_->root_)
+                               : node_->Prev();
+      return *this;
+    }
 
-  return t;
-}
+    AvlNode& operator*() const { return *node_; }
+    AvlNode* operator->() const { return node_; }
 
-}  // namespace internal
+    bool operator==(const iterator& other) const {
+      return node_ == other.node_;
+    }
+    bool operator!=(const iterator& other) const {
+      return node_ != other.node_;
+    }
+
+   private:
+    IntrusiveAvlTree* tree_;
+    AvlNode* node_;
+  };
 
-template <AvlNodeCmp compare>
-class IntrusiveAvlTree {
- public:
   IntrusiveAvlTree() = default;
 
   IntrusiveAvlTree(const IntrusiveAvlTree&) = delete;
@@ -192,36 +217,160 @@ class IntrusiveAvlTree {
   // Returns nullptr if insertion was successful. Otherwise, returns existing
   // node with the same key.
   AvlNode* Insert(AvlNode& node) {
-    AvlNode* ret = internal::Insert<compare>(root_, &node);
-    if (ret == nullptr) {
-      ++size_;
+    AvlNode* parent = nullptr;
+    AvlNode** link = &root_;
+    while (*link != nullptr) {
+      parent = *link;
+      int cmp = compare(&node, parent);
+      if (cmp == 0) {
+        return parent;
+      }
+      link = cmp < 0 ? &parent->left : &parent->right;
     }
-    return ret;
+
+    node.left = nullptr;
+    node.right = nullptr;
+    node.parent = parent;
+    *link = &node;
+    internal::Update<augment>(&node);
+
+    RebalanceUp(parent);
+    ++size_;
+    return nullptr;
   }
 
   // Returns erased node.
   AvlNode* Erase(AvlNode& key) {
-    AvlNode* ret = internal::Erase<compare>(root_, &key);
-    if (ret != nullptr) {
-      --size_;
+    AvlNode* t = Find([&](AvlNode* node) { return compare(&key, node); });
+    if (t != nullptr) {
+      Remove(*t);
+    }
+    return t;
+  }
+
+  // Unlinks `node`, which must be in the tree, without searching for it.
+  void Remove(AvlNode& node) {
+    AvlNode*& link = LinkOf(&node);
+    AvlNode* rebalance_from = nullptr;
+
+    if (node.left == nullptr || node.right == nullptr) {
+      AvlNode* child = node.left != nullptr ? node.left : node.right;
+      if (child != nullptr) {
+        child->parent = node.parent;
+      }
+      link = child;
+      rebalance_from = node.parent;
+    } else {
+      // Replace the node with its successor.
+      AvlNode* successor = internal::Leftmost(node.right);
+      if (successor->parent != &node) {
+        rebalance_from = successor->parent;
+
+        successor->parent->left = successor->right;
+        if (successor->right != nullptr) {
+          successor->right->parent = successor->parent;
+        }
+        successor->right = node.right;
+        node.right->parent = successor;
+      } else {
+        rebalance_from = successor;
+      }
+
+      successor->left = node.left;
+      node.left->parent = successor;
+      successor->parent = node.parent;
+      link = successor;
     }
-    return ret;
+
+    RebalanceUp(rebalance_from);
+    --size_;
   }
 
+  // `func(node)` returns -1 if the key is before `node`, 1 if it is after and 0
+  // on a match.
   template <typename Func>
   AvlNode* Find(Func func) {
-    return internal::Find<Func>(root_, func);
+    AvlNode* t = root_;
+    while (t != nullptr) {
+      int cmp = func(t);
+      if (cmp == 0) {
+        return t;
+      }
+      t = cmp < 0 ? t->left : t->right;
+    }
+
+    return nullptr;
+  }
+
+  // First node which the key isn't after, with `func` as in `Find`.
+  template <typename Func>
+  iterator LowerBound(Func func) {
+    return iterator(this, internal::Bound(root_, func, /*strict=*/false));
   }
 
+  // First node which the key is before, with `func` as in `Find`.
+  template <typename Func>
+  iterator UpperBound(Func func) {
+    return iterator(this, internal::Bound(root_, func, /*strict=*/true));
+  }
+
+  // Children are visited before their parent, so `func` may free its node.
   template <typename Func>
   void ForEachBottomUp(Func func) {
-    internal::ForEachBottomUp(root_, func);
+    if (root_ == nullptr) {
+      return;
+    }
+
+    AvlNode* node = internal::FirstPostOrder(root_);
+    while (node != nullptr) {
+      AvlNode* parent = node->parent;
+      AvlNode* next = parent;
+      if (parent != nullptr && parent->left == node &&
+          parent->right != nullptr) {
+        next = internal::FirstPostOrder(parent->right);
+      }
+
+      func(node);
+      node = next;
+    }
   }
 
+  // Must be called after changing the data `augment` reads from `node` in
+  // place. The change must not move `node` relative to its neighbors.
+  void Reaugment(AvlNode& node) {
+    static_assert(augment != nullptr, "Tree isn't augmented");
+    for (AvlNode* t = &node; t != nullptr; t = t->parent) {
+      augment(t);
+    }
+  }
+
+  iterator begin() {
+    return iterator(this,
+                    root_ == nullptr ? nullptr : internal::Leftmost(root_));
+  }
+  iterator end() { return iterator(this, nullptr); }
+
   size_t size() const { return size_; }
   AvlNode* root() { return root_; }
 
  private:
+  AvlNode*& LinkOf(AvlNode* node) {
+    AvlNode* parent = node->parent;
+    if (parent == nullptr) {
+      return root_;
+    }
+    return parent->left == node ? parent->left : parent->right;
+  }
+
+  // Restores heights, balance and aggregates from `node` up to the root.
+  void RebalanceUp(AvlNode* node) {
+    while (node != nullptr) {
+      AvlNode* parent = node->parent;
+      internal::Rebalance<augment>(node, LinkOf(node));
+      node = parent;
+    }
+  }
+
   size_t size_ = 0;
   AvlNode* root_ = nullptr;
 };
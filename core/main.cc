@@ -83,4 +83,8 @@ extern "C" void kernel_main(multiboot_info_t* mbd, unsigned int magic) {
 
   big1 = new Big(1);
   printf("big1: %p, big2: %p, big3: %p\n", big1, big2, big3);
+
+  // Nothing else to run, so spend idle time zeroing free frames.
+  while (mm::ZeroFreePages(16) > 0) {
+  }
 }
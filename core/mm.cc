@@ -4,12 +4,14 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
 
 #include <algorithm>
-#include <utility>
+#include <new>
 
 #include "core/addr-mgr.h"
-#include "core/cleanup.h"
+#include "core/buddy-allocator.h"
+#include "core/b-tree.h"
 #include "core/macros.h"
 #include "libc/macros.h"
 #include "libc/malloc.h"
@@ -18,32 +20,173 @@ namespace mm {
 namespace {
 
 AddrMgr g_kernel_va_mgr;
-AddrMgr g_pa_mgr;
-
-// Page allocation requires requires heap allocation.
-// Heap allocation requires page allocation.
-//
-// To solve chicken/egg problem use a single static page.
-struct DefaultPage {
-  char data[PAGE_SIZE];
+BuddyAllocator g_pa_mgr;
+
+// Physical memory directly after the kernel image used for boot time
+// allocations. It is mapped with the boot page table.
+uintptr_t g_boot_alloc_end = 0;
+
+// Descriptors of every managed frame, indexed by PFN.
+Pages* g_mem_map = nullptr;
+size_t g_mem_map_size = 0;
+
+// Single free frames kept per CPU in front of `g_pa_mgr`, so most one page
+// allocations and frees are a list operation on the local CPU. Freed frames go
+// to the front, where they are handed out again while still cache hot, and the
+// cold end is drained back in batches.
+struct FrameCache {
+  IntrusiveList frames;
+  size_t count = 0;
+
+  // Frames already cleared by `ZeroFreePages`, for `kAllocZeroed`.
+  IntrusiveList zeroed;
+  size_t num_zeroed = 0;
 };
 
-alignas(PAGE_SIZE) DefaultPage g_default_page;
-bool g_default_page_used = false;
+constexpr size_t kFrameCacheBatch = 16;
+constexpr size_t kFrameCacheHigh = 4 * kFrameCacheBatch;
+constexpr size_t kZeroedFramesMax = 256;
 
-PhysAddr AllocAndMapPhysPages(const VirtAddr virt_begin, const size_t count) {
-  const PhysAddr phys_begin = AllocPagesPa(count);
-  if (phys_begin == kInvalidPa) {
-    return kInvalidPa;
+FrameCache g_frame_caches[arch::kMaxCpus];
+
+void RefillFrameCache(FrameCache& cache) {
+  // Take the whole batch as one block when there is one.
+  size_t pfn = g_pa_mgr.Alloc(kFrameCacheBatch);
+  if (pfn != BuddyAllocator::kInvalidPfn) {
+    for (size_t i = 0; i < kFrameCacheBatch; ++i) {
+      g_mem_map[pfn + i].flags |= Pages::kCached;
+      cache.frames.push_back(g_mem_map[pfn + i].link);
+    }
+    cache.count += kFrameCacheBatch;
+    return;
+  }
+
+  for (size_t i = 0; i < kFrameCacheBatch; ++i) {
+    pfn = g_pa_mgr.Alloc(1);
+    if (pfn == BuddyAllocator::kInvalidPfn) {
+      return;
+    }
+    g_mem_map[pfn].flags |= Pages::kCached;
+    cache.frames.push_back(g_mem_map[pfn].link);
+    ++cache.count;
   }
-  auto clean_pa = MakeCleanup([&] { FreePagesPa(phys_begin, count); });
+}
 
-  if (arch::MapAddr(arch::cur_page_table, virt_begin, phys_begin, count) < 0) {
-    return kInvalidPa;
+void DrainFrameCache(FrameCache& cache, size_t num_frames) {
+  for (size_t i = 0; i < num_frames && cache.count > 0; ++i) {
+    Pages* frame = CONTAINER_OF(&cache.frames.back(), Pages, link);
+    cache.frames.erase(frame->link);
+    --cache.count;
+    frame->flags &= ~Pages::kCached;
+    g_pa_mgr.Free(frame - g_mem_map, 1);
   }
+}
+
+PhysAddr PopZeroedFrame(FrameCache& cache) {
+  Pages* frame = CONTAINER_OF(&cache.zeroed.front(), Pages, link);
+  cache.zeroed.erase(frame->link);
+  --cache.num_zeroed;
+  frame->flags &= ~Pages::kCached;
+  return frame->pa();
+}
+
+// Gives every cached frame back to `g_pa_mgr`, zeroed ones included.
+void DrainFrameCaches() {
+  for (auto& cache : g_frame_caches) {
+    DrainFrameCache(cache, cache.count);
+
+    while (cache.num_zeroed > 0) {
+      g_pa_mgr.Free(PopZeroedFrame(cache).val() / PAGE_SIZE, 1);
+    }
+  }
+}
+
+PhysAddr AllocFrame(bool zeroed) {
+  FrameCache& cache = g_frame_caches[arch::CpuId()];
+  if (zeroed && cache.num_zeroed > 0) {
+    return PopZeroedFrame(cache);
+  }
+
+  if (cache.count == 0) {
+    RefillFrameCache(cache);
+    if (cache.count == 0) {
+      // Zeroed frames are still free frames.
+      return cache.num_zeroed > 0 ? PopZeroedFrame(cache) : kInvalidPa;
+    }
+  }
+
+  Pages* frame = CONTAINER_OF(&cache.frames.front(), Pages, link);
+  cache.frames.erase(frame->link);
+  --cache.count;
+  frame->flags &= ~Pages::kCached;
+
+  const PhysAddr pa = frame->pa();
+  if (zeroed) {
+    memset(reinterpret_cast<void*>(PaToVa(pa).val()), 0, PAGE_SIZE);
+  }
+  return pa;
+}
+
+void FreeFrame(PhysAddr pa) {
+  Pages& frame = g_mem_map[pa.val() / PAGE_SIZE];
+  // Cached frames never reach `g_pa_mgr`, which would catch this otherwise.
+  PANIC_IF(frame.flags & Pages::kCached, "%s: Double free of pa: %x\n",
+           __func__, pa.val());
+  frame.flags |= Pages::kCached;
+
+  FrameCache& cache = g_frame_caches[arch::CpuId()];
+  cache.frames.push_front(frame.link);
+  if (++cache.count > kFrameCacheHigh) {
+    DrainFrameCache(cache, kFrameCacheBatch);
+  }
+}
+
+// VAs from `ReservePages`, mapping the beginning of each range to its end.
+BTree<uintptr_t, uintptr_t> g_reservations("reservation");
+
+// Returns `g_reservations.end()` if `va` isn't reserved.
+BTree<uintptr_t, uintptr_t>::iterator FindReservation(uintptr_t va) {
+  auto it = g_reservations.UpperBound(va);
+  if (it == g_reservations.begin()) {
+    return g_reservations.end();
+  }
+
+  --it;
+  return va < it.value() ? it : g_reservations.end();
+}
+
+void* BootAlloc(size_t size) {
+  const size_t num_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+  VirtAddr va = arch::MapBootPages(PhysAddr(g_boot_alloc_end), num_pages);
+  PANIC_IF(va == kInvalidVa, "%s: Out of boot memory\n", __func__);
+
+  g_boot_alloc_end += num_pages * PAGE_SIZE;
+  return reinterpret_cast<void*>(va.val());
+}
+
+// Calls `func(begin, end)` for each page aligned range of available physical
+// memory.
+template <typename Func>
+void ForEachAvailablePa(multiboot_info_t* mbd, Func func) {
+  for (int i = 0; i < mbd->mmap_length; i += sizeof(multiboot_memory_map_t)) {
+    auto* mmmt = reinterpret_cast<multiboot_memory_map_t*>(mbd->mmap_addr + i);
+    if (mmmt->type != MULTIBOOT_MEMORY_AVAILABLE) {
+      continue;
+    }
+
+    // Ignore memory we can't address.
+    const u64 max_pa = UINTPTR_MAX - PAGE_SIZE + 1;
+    if (mmmt->addr >= max_pa) {
+      continue;
+    }
+    u64 end = std::min(mmmt->addr + mmmt->len, max_pa);
 
-  std::move(clean_pa).Cancel();
-  return phys_begin;
+    const uintptr_t begin = ROUND_UP_TO(mmmt->addr, PAGE_SIZE);
+    end -= end % PAGE_SIZE;
+    if (begin < end) {
+      func(begin, static_cast<uintptr_t>(end));
+    }
+  }
 }
 
 }  // namespace
@@ -53,110 +196,304 @@ void Init(multiboot_info_t* mbd) {
     PANIC("invalid memory map given by GRUB bootloader");
   }
 
-  uintptr_t num_heap_pages = (0 - PAGE_SIZE - KERNEL_HEAP_VA) / PAGE_SIZE;
-  int err = g_kernel_va_mgr.AddVas(KERNEL_HEAP_VA, num_heap_pages);
-  PANIC_IF(err != 0, "Registering virtual addresses failed");
-
   const uintptr_t kernel_begin = arch::KernelBegin();
   const uintptr_t kernel_end = arch::KernelEnd();
   printf("kernel_pa: [%x, %x)\n", kernel_begin, kernel_end);
 
-  for (int i = 0; i < mbd->mmap_length; i += sizeof(multiboot_memory_map_t)) {
-    auto* mmmt = reinterpret_cast<multiboot_memory_map_t*>(mbd->mmap_addr + i);
-    if (mmmt->type != MULTIBOOT_MEMORY_AVAILABLE) {
-      continue;
+  // `mem_map` is placed directly after the kernel, so the number of
+  // frames we can manage is limited by what the boot page table can map.
+  g_boot_alloc_end = ROUND_UP_TO(kernel_end, PAGE_SIZE);
+  {
+    uintptr_t max_pa = 0;
+    ForEachAvailablePa(mbd, [&](uintptr_t begin, uintptr_t end) {
+      max_pa = std::max(max_pa, end);
+    });
+
+    const uintptr_t boot_map_end = arch::BootMapEnd();
+    PANIC_IF(g_boot_alloc_end >= boot_map_end, "Kernel image too large\n");
+
+    // Every managed frame must also be in the direct map.
+    size_t num_frames = max_pa / PAGE_SIZE;
+    const size_t max_frames =
+        std::min<size_t>((boot_map_end - g_boot_alloc_end) /
+                             (sizeof(Pages) + sizeof(u32)),
+                         DIRECT_MAP_SIZE / PAGE_SIZE);
+    if (num_frames > max_frames) {
+      num_frames = max_frames;
+      printf("Ignoring PAs above %x\n", num_frames * PAGE_SIZE);
     }
 
-    uintptr_t begin = mmmt->addr;
-    uintptr_t end = begin + mmmt->len;
-
-    auto register_pa = [](uintptr_t begin, uintptr_t end) {
-      if (begin == end) {
-        return;
-      }
+    const uintptr_t boot_begin = g_boot_alloc_end;
+    g_mem_map =
+        reinterpret_cast<Pages*>(BootAlloc(num_frames * sizeof(Pages)));
+    void* mem = BootAlloc(BuddyAllocator::MetadataSize(num_frames));
 
-      printf("Registering PAs: [%x, %x)\n", begin, end);
-      int err = g_pa_mgr.AddVas(begin, (end - begin) / PAGE_SIZE);
-      PANIC_IF(err != 0, "Registering physical addresses failed");
+    // GRUB may place its structures anywhere, make sure we don't clobber the
+    // memory map before reading it again below.
+    auto overlaps_boot = [&](uintptr_t addr, size_t len) {
+      return addr < g_boot_alloc_end && addr + len > boot_begin;
     };
+    PANIC_IF(overlaps_boot(reinterpret_cast<uintptr_t>(mbd), sizeof(*mbd)) ||
+                 overlaps_boot(mbd->mmap_addr, mbd->mmap_length),
+             "Multiboot info overlaps boot allocations\n");
 
-    if (kernel_begin >= begin && kernel_end <= end) {
+    // All frames start out reserved until found in the memory map.
+    for (size_t i = 0; i < num_frames; ++i) {
+      new (&g_mem_map[i]) Pages;
+    }
+    g_mem_map_size = num_frames;
+
+    g_pa_mgr.Init(g_mem_map, mem, num_frames);
+  }
+
+  const uintptr_t reserved_end = g_boot_alloc_end;
+  const uintptr_t managed_end = g_pa_mgr.num_frames() * PAGE_SIZE;
+
+  auto register_pa = [&](uintptr_t begin, uintptr_t end) {
+    end = std::min(end, managed_end);
+    if (begin >= end) {
+      return;
+    }
+
+    printf("Registering PAs: [%x, %x)\n", begin, end);
+    for (uintptr_t pa = begin; pa < end; pa += PAGE_SIZE) {
+      g_mem_map[pa / PAGE_SIZE].flags &= ~Pages::kReserved;
+    }
+    g_pa_mgr.Free(begin / PAGE_SIZE, (end - begin) / PAGE_SIZE);
+  };
+
+  ForEachAvailablePa(mbd, [&](uintptr_t begin, uintptr_t end) {
+    if (kernel_begin >= begin && reserved_end <= end) {
       register_pa(begin, kernel_begin);
 
-      begin = kernel_end;
+      begin = reserved_end;
       end = std::max(begin, end);
     }
 
-    if (kernel_end >= begin && kernel_end <= end) {
-      begin = kernel_end;
+    if (reserved_end >= begin && reserved_end <= end) {
+      begin = reserved_end;
     }
 
     register_pa(begin, end);
-  }
+  });
+
+  uintptr_t num_heap_pages = (PAGE_TABLES_VA - KERNEL_HEAP_VA) / PAGE_SIZE;
+  int err = g_kernel_va_mgr.AddVas(KERNEL_HEAP_VA, num_heap_pages);
+  PANIC_IF(err != 0, "Registering virtual addresses failed");
 }
 
-PagesRef AllocPages(const size_t count) {
-  if (count <= 0) {
-    return {};
-  }
+uintptr_t DirectMapEnd() { return g_pa_mgr.num_frames() * PAGE_SIZE; }
 
-  PagesRef ret(new Pages());
-  if (!ret) {
+PagesRef AllocPages(const size_t count, const u32 flags) {
+  if (count <= 0) {
     return {};
   }
 
-  ret->count = count;
-  ret->va = AllocPagesVa(count);
-  if (ret->va == kInvalidVa) {
+  const PhysAddr pa = AllocPagesPa(count, flags);
+  if (pa == kInvalidPa) {
     return {};
   }
-  auto clean_va = MakeCleanup([&] { FreePagesVa(ret->va, count); });
 
-  ret->pa = AllocAndMapPhysPages(ret->va, count);
-  if (ret->pa == kInvalidPa) {
-    return {};
-  }
+  Pages* pages = PaToPages(pa);
+  assert(pages->RefCnt() == 0);
+  pages->count = count;
+  pages->flags |= Pages::kHead;
+  pages->IncRef();
 
-  std::move(clean_va).Cancel();
-  return ret;
+  return PagesRef::Adopt(pages);
 }
 
 void FreePages(Pages* pages) {
   assert(pages->RefCnt() == 0);
+  assert(pages->flags & Pages::kHead);
+
+  const size_t count = pages->count;
+  pages->count = 0;
+  pages->flags &= ~Pages::kHead;
 
-  UnmapAddr(arch::cur_page_table, pages->va, pages->count);
-  FreePagesPa(pages->pa, pages->count);
-  FreePagesVa(pages->va, pages->count);
-  delete pages;
+  FreePagesPa(pages->pa(), count);
 }
 
-VirtAddr AllocPagesVa(size_t num_pages) {
-  return VirtAddr(g_kernel_va_mgr.Alloc(num_pages));
+VirtAddr AllocPagesVa(size_t num_pages, size_t align_pages) {
+  assert(align_pages > 0 && (align_pages & (align_pages - 1)) == 0);
+
+  uintptr_t va = g_kernel_va_mgr.Alloc(num_pages, align_pages);
+  if (va == 0) {
+    return kInvalidVa;
+  }
+
+  return VirtAddr(va);
 }
 
 void FreePagesVa(VirtAddr addr, size_t num_pages) {
   g_kernel_va_mgr.Free(addr.val(), num_pages);
 }
 
-PhysAddr AllocPagesPa(size_t num_pages) {
-  return PhysAddr(g_pa_mgr.Alloc(num_pages));
+VirtAddr ReservePages(size_t num_pages) {
+  if (num_pages <= 0) {
+    return kInvalidVa;
+  }
+
+  const VirtAddr va = AllocPagesVa(num_pages);
+  if (va == kInvalidVa) {
+    return kInvalidVa;
+  }
+
+  if (g_reservations.Insert(va.val(), va.val() + num_pages * PAGE_SIZE) < 0) {
+    FreePagesVa(va, num_pages);
+    return kInvalidVa;
+  }
+  return va;
+}
+
+void FreeReservedPages(VirtAddr addr) {
+  auto it = g_reservations.Find(addr.val());
+  assert(it != g_reservations.end());
+  const uintptr_t end = it.value();
+  g_reservations.Erase(it);
+
+  // Only pages which were touched are backed.
+  for (uintptr_t va = addr.val(); va < end; va += PAGE_SIZE) {
+    const PhysAddr pa = arch::LookupPa(arch::cur_page_table, VirtAddr(va));
+    if (pa != kInvalidPa) {
+      arch::UnmapAddr(arch::cur_page_table, VirtAddr(va), 1);
+      FreePagesPa(pa, 1);
+    }
+  }
+  arch::FlushTlb();
+
+  FreePagesVa(addr, (end - addr.val()) / PAGE_SIZE);
+}
+
+bool HandlePageFault(VirtAddr va) {
+  if (FindReservation(va.val()) == g_reservations.end()) {
+    return false;
+  }
+
+  const PhysAddr pa = AllocPagesPa(1, kAllocZeroed);
+  PANIC_IF(pa == kInvalidPa, "Out of memory backing reserved page %x\n",
+           va.val());
+
+  // The page wasn't present, so there is no stale TLB entry to flush.
+  const VirtAddr page_va(va.val() - va.val() % PAGE_SIZE);
+  if (arch::MapAddr(arch::cur_page_table, page_va, pa, 1) < 0) {
+    FreePagesPa(pa, 1);
+    return false;
+  }
+
+  return true;
+}
+
+PhysAddr AllocPagesPa(size_t num_pages, u32 flags) {
+  if (num_pages == 1) {
+    return AllocFrame(flags & kAllocZeroed);
+  }
+
+  size_t pfn = g_pa_mgr.Alloc(num_pages);
+  if (pfn == BuddyAllocator::kInvalidPfn) {
+    // Cached frames may be what is keeping a block from merging.
+    DrainFrameCaches();
+    pfn = g_pa_mgr.Alloc(num_pages);
+    if (pfn == BuddyAllocator::kInvalidPfn) {
+      return kInvalidPa;
+    }
+  }
+
+  const PhysAddr pa(pfn * PAGE_SIZE);
+  if (flags & kAllocZeroed) {
+    memset(reinterpret_cast<void*>(PaToVa(pa).val()), 0,
+           num_pages * PAGE_SIZE);
+  }
+  return pa;
+}
+
+size_t ZeroFreePages(size_t max_pages) {
+  FrameCache& cache = g_frame_caches[arch::CpuId()];
+
+  size_t num_zeroed = 0;
+  while (num_zeroed < max_pages && cache.num_zeroed < kZeroedFramesMax) {
+    if (cache.count == 0) {
+      RefillFrameCache(cache);
+      if (cache.count == 0) {
+        break;
+      }
+    }
+
+    Pages* frame = CONTAINER_OF(&cache.frames.front(), Pages, link);
+    cache.frames.erase(frame->link);
+    --cache.count;
+
+    arch::ZeroPage(frame->va());
+    cache.zeroed.push_front(frame->link);
+    ++cache.num_zeroed;
+    ++num_zeroed;
+  }
+
+  return num_zeroed;
 }
 
 void FreePagesPa(PhysAddr addr, size_t num_pages) {
-  g_pa_mgr.Free(addr.val(), num_pages);
+  assert(addr.val() % PAGE_SIZE == 0);
+  if (num_pages == 1) {
+    FreeFrame(addr);
+    return;
+  }
+
+  g_pa_mgr.Free(addr.val() / PAGE_SIZE, num_pages);
+}
+
+Pages* PaToPages(PhysAddr pa) {
+  const size_t pfn = pa.val() / PAGE_SIZE;
+  if (pfn >= g_mem_map_size) {
+    return nullptr;
+  }
+
+  return &g_mem_map[pfn];
 }
 
 }  // namespace mm
 
-void* __malloc_alloc_pages(const size_t count) {
+PhysAddr Pages::pa() const {
+  return PhysAddr((this - mm::g_mem_map) * PAGE_SIZE);
+}
+
+VirtAddr Pages::va() const { return mm::PaToVa(pa()); }
+
+namespace {
+
+// Frees the physical pages mapped at `[va, va + num_pages * PAGE_SIZE)`, a run
+// of contiguous pages at a time.
+void FreeMappedPas(VirtAddr va, size_t num_pages) {
+  size_t i = 0;
+  while (i < num_pages) {
+    const PhysAddr pa = LookupPa(arch::cur_page_table, va + i * PAGE_SIZE);
+    assert(pa != kInvalidPa);
+
+    size_t run = 1;
+    while (i + run < num_pages &&
+           LookupPa(arch::cur_page_table, va + (i + run) * PAGE_SIZE) ==
+               pa + run * PAGE_SIZE) {
+      ++run;
+    }
+
+    mm::FreePagesPa(pa, run);
+    i += run;
+  }
+}
+
+}  // namespace
+
+void* __malloc_alloc_pages(const size_t count, const bool zeroed) {
   if (count <= 0) {
     return nullptr;
   }
 
-  if (!mm::g_default_page_used) {
-    assert(count == 1);
-    mm::g_default_page_used = true;
-    return &mm::g_default_page;
+  const u32 flags = zeroed ? u32{mm::kAllocZeroed} : 0;
+
+  // Contiguous physical pages are already mapped.
+  const PhysAddr direct_pa = mm::AllocPagesPa(count, flags);
+  if (direct_pa != kInvalidPa) {
+    return reinterpret_cast<void*>(mm::PaToVa(direct_pa).val());
   }
 
   const VirtAddr virt_begin = mm::AllocPagesVa(count);
@@ -164,44 +501,64 @@ void* __malloc_alloc_pages(const size_t count) {
     return nullptr;
   }
 
-  // Malloc doesn't need contiguous physical pages.
-  size_t i = 0;
-  for (; i < count; ++i) {
-    VirtAddr va = virt_begin + i * PAGE_SIZE;
-    PhysAddr pa = mm::AllocAndMapPhysPages(va, 1);
+  // Malloc doesn't need contiguous physical pages. Take the largest blocks
+  // available and map them a batch of runs at a time.
+  constexpr size_t kMaxRuns = 8;
+  PaRun runs[kMaxRuns];
+  size_t num_runs = 0;
+  size_t num_gathered = 0;
+  size_t num_mapped = 0;
+  size_t run_pages = count;
+
+  while (num_mapped + num_gathered < count) {
+    run_pages = std::min(run_pages, count - num_mapped - num_gathered);
+    const PhysAddr pa = mm::AllocPagesPa(run_pages, flags);
     if (pa == kInvalidPa) {
-      goto error;
+      if (run_pages == 1) {
+        goto error;
+      }
+      run_pages /= 2;
+      continue;
+    }
+
+    runs[num_runs++] = {pa, run_pages};
+    num_gathered += run_pages;
+
+    if (num_runs == kMaxRuns || num_mapped + num_gathered == count) {
+      const VirtAddr va = virt_begin + num_mapped * PAGE_SIZE;
+      if (arch::MapAddr(arch::cur_page_table, va, runs, num_runs) < 0) {
+        goto error;
+      }
+      num_mapped += num_gathered;
+      num_gathered = 0;
+      num_runs = 0;
     }
   }
 
   return reinterpret_cast<void*>(virt_begin.val());
 
 error:
-  arch::UnmapAddr(arch::cur_page_table, virt_begin, i);
-  for (size_t j = 0; j < i; ++j) {
-    VirtAddr va = virt_begin + j * PAGE_SIZE;
-    PhysAddr pa = LookupPa(arch::cur_page_table, va);
-    mm::FreePagesPa(pa, 1);
+  for (size_t i = 0; i < num_runs; ++i) {
+    mm::FreePagesPa(runs[i].pa, runs[i].count);
   }
 
+  FreeMappedPas(virt_begin, num_mapped);
+  arch::UnmapAddr(arch::cur_page_table, virt_begin, num_mapped);
+  arch::FlushTlb();
   mm::FreePagesVa(virt_begin, count);
   return nullptr;
 }
 
 void __malloc_free_page(void* addr, size_t num_pages) {
-  if (addr == &mm::g_default_page) {
-    mm::g_default_page_used = false;
+  VirtAddr virt_begin(reinterpret_cast<uintptr_t>(addr));
+  if (virt_begin.val() < KERNEL_HEAP_VA) {
+    mm::FreePagesPa(mm::VaToPa(virt_begin), num_pages);
     return;
   }
 
-  VirtAddr virt_begin(reinterpret_cast<uintptr_t>(addr));
-  for (size_t i = 0; i < num_pages; ++i) {
-    PhysAddr pa =
-        arch::LookupPa(arch::cur_page_table, virt_begin + i * PAGE_SIZE);
-    assert(pa != kInvalidPa);
-    mm::FreePagesPa(pa, 1);
-  }
+  FreeMappedPas(virt_begin, num_pages);
 
   arch::UnmapAddr(arch::cur_page_table, virt_begin, num_pages);
+  arch::FlushTlb();
   mm::FreePagesVa(virt_begin, num_pages);
 }
@@ -1,11 +1,13 @@
 #pragma once
 
+#include <arch.h>
 #include <assert.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #include "core/ref-cnt.h"
 #include "core/types.h"
+#include "libc/intrusive-list.h"
 #include "third_party/multiboot.h"
 
 struct Pages;
@@ -14,42 +16,104 @@ namespace mm {
 void FreePages(Pages* pages);
 }  // namespace mm
 
-// Contiguous physical pages.
+// Descriptor of a physical page frame.
+//
+// `mm` keeps one for every frame in `mem_map`, an array indexed by PFN which is
+// set up at boot. A contiguous allocation is described by the descriptor of its
+// first frame.
 struct Pages {
-  VirtAddr va{0};
-  PhysAddr pa{0};
-  int count = 0;
-
-  int RefCnt() const { return ref_cnt; }
-  int IncRef() { return ++ref_cnt; }
-  int DecRef() {
-    assert(ref_cnt > 0);
-    return --ref_cnt;
-  }
-
- private:
-  // TODO(bcf): Should be atomic.
-  int ref_cnt = 1;
+  enum Flags : u8 {
+    // Not available for allocation, e.g. holes and the kernel image.
+    kReserved = 1 << 0,
+    // First frame of an allocation from `mm::AllocPages`.
+    kHead = 1 << 1,
+    // Free and held by a per-CPU frame cache instead of the buddy allocator.
+    kCached = 1 << 2,
+  };
+
+  PhysAddr pa() const;
+  // Address in the direct map.
+  VirtAddr va() const;
+
+  // Size of the allocation. Only set for `kHead` frames.
+  u32 count = 0;
+
+  // Buddy allocator linkage, used while the frame heads a free block.
+  IntrusiveList::Node link;
+  u8 order = 0;
+
+  u8 flags = kReserved;
+
+  int RefCnt() const { return ref_cnt.Get(); }
+  int IncRef() { return ref_cnt.Inc(); }
+  int DecRef() { return ref_cnt.Dec(); }
+
+  RefCount ref_cnt;
 };
 
 using PagesRef = Ref<Pages, mm::FreePages>;
 
+// Physically contiguous pages `[pa, pa + count * PAGE_SIZE)`.
+struct PaRun {
+  PhysAddr pa;
+  size_t count;
+};
+
 namespace mm {
 
 void Init(multiboot_info_t* mbd);
 
-// Returns NULL on failure.
-PagesRef AllocPages(size_t count);
+// Physical memory below `DirectMapEnd()` is permanently mapped at
+// `KERNEL_HIGH_VA + pa`. All managed frames are.
+uintptr_t DirectMapEnd();
+
+inline VirtAddr PaToVa(PhysAddr pa) {
+  return VirtAddr(pa.val() + KERNEL_HIGH_VA);
+}
+
+inline PhysAddr VaToPa(VirtAddr va) {
+  assert(va.val() >= KERNEL_HIGH_VA && va.val() < KERNEL_HEAP_VA);
+  return PhysAddr(va.val() - KERNEL_HIGH_VA);
+}
+
+enum AllocFlags : u32 {
+  // Clear the pages. Single pages come from a pool zeroed ahead of time when
+  // possible.
+  kAllocZeroed = 1 << 0,
+};
+
+// Physically contiguous pages, accessed through the direct map. Returns NULL on
+// failure. Allocations are aligned to their size rounded up to a power of two.
+PagesRef AllocPages(size_t count, u32 flags = 0);
 void FreePages(Pages* pages);
 
-// Returns kInvalidVa on failure.
-VirtAddr AllocPagesVa(size_t num_pages);
+// Kernel VAs which aren't backed by anything yet, for mapping non-contiguous
+// physical pages. Returns kInvalidVa on failure.
+VirtAddr AllocPagesVa(size_t num_pages, size_t align_pages = 1);
 void FreePagesVa(VirtAddr addr, size_t num_pages);
 
+// Kernel VAs which are backed with zeroed pages on first touch, so only the
+// pages actually used consume physical memory. Returns kInvalidVa on failure.
+VirtAddr ReservePages(size_t num_pages);
+// Releases a reservation from `ReservePages` along with its backed pages.
+void FreeReservedPages(VirtAddr addr);
+
+// Backs the page containing `va` if it is reserved. Returns false if the fault
+// can't be handled. Called by arch on faults on non-present pages.
+bool HandlePageFault(VirtAddr va);
+
 // Returns kInvalidPa on failure.
-PhysAddr AllocPagesPa(size_t num_pages);
+PhysAddr AllocPagesPa(size_t num_pages, u32 flags = 0);
 void FreePagesPa(PhysAddr addr, size_t num_pages);
 
+// Zeroes up to `max_pages` free frames for `kAllocZeroed` to hand out. Meant to
+// run while the CPU has nothing else to do. Returns the number of frames
+// zeroed, 0 once the pool is full.
+size_t ZeroFreePages(size_t max_pages);
+
+// Descriptor of the frame containing `pa`. nullptr if `pa` isn't managed.
+Pages* PaToPages(PhysAddr pa);
+
 }  // namespace mm
 
 namespace arch {
@@ -60,11 +124,28 @@ extern PageTableRoot* cur_page_table;
 uintptr_t KernelBegin();
 uintptr_t KernelEnd();
 
+// Maps `[pa, pa + num_pages * PAGE_SIZE)` at `pa + KERNEL_HIGH_VA` with the
+// boot page table, before the direct map is set up. Only for early boot
+// allocations placed directly after the kernel image. Returns kInvalidVa if the
+// range is beyond `BootMapEnd()`.
+VirtAddr MapBootPages(PhysAddr pa, size_t num_pages);
+
+// End of the physical addresses `MapBootPages` can map.
+uintptr_t BootMapEnd();
+
 void SetPageTable(PageTableRoot* page_table);
+
+// Invalidates stale TLB entries left by `UnmapAddr` on the current page table.
 void FlushTlb();
 
+// Zeroes the page at `va`, without pulling it into the cache where possible.
+void ZeroPage(VirtAddr va);
+
 int MapAddr(PageTableRoot* page_table, VirtAddr va, PhysAddr pa,
             size_t num_pages);
+// Maps `runs` back to back starting at `va`.
+int MapAddr(PageTableRoot* page_table, VirtAddr va, const PaRun* runs,
+            size_t num_runs);
 void UnmapAddr(PageTableRoot* page_table, VirtAddr va, size_t num_pages);
 PhysAddr LookupPa(PageTableRoot* page_table, VirtAddr va);
 
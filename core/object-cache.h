@@ -0,0 +1,201 @@
+#pragma once
+
+#include <arch.h>
+#include <assert.h>
+#include <stddef.h>
+
+#include <new>
+#include <utility>
+
+#include "core/mm.h"
+#include "core/types.h"
+#include "libc/intrusive-list.h"
+#include "libc/macros.h"
+
+struct ObjectCacheStats {
+  size_t num_slabs = 0;
+  size_t num_objs = 0;
+  size_t num_used = 0;
+  size_t num_allocs = 0;
+  size_t num_frees = 0;
+};
+
+// Cache of objects of type `T`, in the style of kmem_cache.
+//
+// Objects are carved out of slabs of `kSlabPages` physically contiguous pages
+// from `mm::AllocPages`. Each slab starts with a header holding a bitmap of its
+// free objects, and slabs are aligned to their size so an object's slab is
+// found by masking its address. Allocation and free are O(1) and never touch
+// the general heap.
+//
+// Without a constructor, objects are default constructed on `Alloc` and
+// destroyed on `Free`. With one, objects are constructed once when their slab
+// is created and must be returned to the cache in their constructed state.
+//
+// `Alloc` grows the cache by a slab once it is down to `reserve` free objects.
+// Slabs are reached through the direct map, so growing never needs objects
+// from a cache itself. The reserve keeps a few objects on hand for paths
+// which can't easily fail, e.g. `AddrMgr::Free` needing a `Region`, when
+// `mm::AllocPages` is out of memory. Caches needed before `mm` is up can be
+// seeded with a boot slab.
+template <typename T>
+class ObjectCache {
+ public:
+  using Ctor = void (*)(T* obj);
+
+  static constexpr size_t kSlabPages = DIV_ROUND_UP(8 * sizeof(T), PAGE_SIZE);
+  static constexpr size_t kSlabSize = kSlabPages * PAGE_SIZE;
+  static_assert((kSlabPages & (kSlabPages - 1)) == 0,
+                "Slab size must be a power of two");
+
+  // `boot_slab` must be `kSlabSize` bytes aligned to `kSlabSize`.
+  ObjectCache(const char* name, size_t reserve, Ctor ctor = nullptr,
+              void* boot_slab = nullptr)
+      : name_(name), reserve_(reserve), ctor_(ctor) {
+    if (boot_slab != nullptr) {
+      AddSlab(boot_slab, PagesRef());
+    }
+  }
+
+  ObjectCache(const ObjectCache&) = delete;
+  ObjectCache& operator=(const ObjectCache&) = delete;
+
+  // Returns nullptr on failure.
+  T* Alloc() {
+    if (num_free() <= reserve_) {
+      Grow();
+    }
+
+    if (partial_.empty()) {
+      return nullptr;
+    }
+
+    Slab* slab = CONTAINER_OF(&*partial_.begin(), Slab, link);
+    int idx = slab->TakeFree();
+    if (slab->num_free == 0) {
+      partial_.erase(slab->link);
+    }
+
+    ++stats_.num_used;
+    ++stats_.num_allocs;
+
+    T* obj = Obj(slab, idx);
+    if (ctor_ == nullptr) {
+      new (obj) T;
+    }
+    return obj;
+  }
+
+  void Free(T* obj) {
+    if (obj == nullptr) {
+      return;
+    }
+
+    if (ctor_ == nullptr) {
+      obj->~T();
+    }
+
+    Slab* slab = SlabOf(obj);
+    slab->PutFree(Idx(slab, obj));
+    if (slab->num_free == 1) {
+      partial_.push_front(slab->link);
+    }
+
+    --stats_.num_used;
+    ++stats_.num_frees;
+  }
+
+  const ObjectCacheStats& stats() const { return stats_; }
+  size_t num_free() const { return stats_.num_objs - stats_.num_used; }
+
+ private:
+  static constexpr size_t kMaxObjs = kSlabSize / sizeof(T);
+  static constexpr size_t kFreeMapWords = DIV_ROUND_UP(kMaxObjs, 32);
+
+  struct Slab {
+    IntrusiveList::Node link;
+    PagesRef pages;
+    u32 num_free = 0;
+    u32 free_map[kFreeMapWords] = {};
+
+    int TakeFree() {
+      assert(num_free > 0);
+      for (size_t i = 0; i < kFreeMapWords; ++i) {
+        if (free_map[i] != 0) {
+          int bit = __builtin_ctz(free_map[i]);
+          free_map[i] &= ~(1u << bit);
+          --num_free;
+          return i * 32 + bit;
+        }
+      }
+
+      assert(false);
+      return -1;
+    }
+
+    void PutFree(int idx) {
+      u32& word = free_map[idx / 32];
+      assert(!(word & (1u << (idx % 32))));
+      word |= 1u << (idx % 32);
+      ++num_free;
+    }
+  };
+
+  static constexpr size_t kObjOffset = ROUND_UP_TO(sizeof(Slab), alignof(T));
+  static constexpr size_t kNumObjs = (kSlabSize - kObjOffset) / sizeof(T);
+  static_assert(kNumObjs > 0);
+
+  static T* Obj(Slab* slab, int idx) {
+    char* objs = reinterpret_cast<char*>(slab) + kObjOffset;
+    return reinterpret_cast<T*>(objs) + idx;
+  }
+
+  static int Idx(Slab* slab, const T* obj) {
+    int idx = obj - Obj(slab, 0);
+    assert(idx >= 0 && idx < static_cast<int>(kNumObjs));
+    return idx;
+  }
+
+  static Slab* SlabOf(const T* obj) {
+    auto addr = reinterpret_cast<uintptr_t>(obj);
+    return reinterpret_cast<Slab*>(addr & ~(kSlabSize - 1));
+  }
+
+  bool Grow() {
+    // Allocations are aligned to their size.
+    PagesRef pages = mm::AllocPages(kSlabPages);
+    if (!pages) {
+      return false;
+    }
+
+    void* mem = reinterpret_cast<void*>(pages->va().val());
+    AddSlab(mem, std::move(pages));
+    return true;
+  }
+
+  void AddSlab(void* mem, PagesRef pages) {
+    assert(reinterpret_cast<uintptr_t>(mem) % kSlabSize == 0);
+
+    auto* slab = new (mem) Slab;
+    slab->pages = std::move(pages);
+    for (size_t i = 0; i < kNumObjs; ++i) {
+      slab->PutFree(i);
+      if (ctor_ != nullptr) {
+        ctor_(Obj(slab, i));
+      }
+    }
+    partial_.push_front(slab->link);
+
+    ++stats_.num_slabs;
+    stats_.num_objs += kNumObjs;
+  }
+
+  const char* const name_;
+  const size_t reserve_;
+  const Ctor ctor_;
+
+  ObjectCacheStats stats_;
+
+  // Slabs with at least one free object.
+  IntrusiveList partial_;
+};
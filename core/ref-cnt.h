@@ -1,34 +1,85 @@
 #pragma once
 
+#include <assert.h>
+
+#include <atomic>
+
+// Intrusive reference count for objects managed with `Ref`.
+class RefCount {
+ public:
+  RefCount() = default;
+
+  RefCount(const RefCount&) = delete;
+  RefCount& operator=(const RefCount&) = delete;
+
+  int Get() const { return cnt_.load(std::memory_order_relaxed); }
+
+  // A new reference can only be made from an existing one, so there's nothing
+  // to synchronize with.
+  int Inc() { return cnt_.fetch_add(1, std::memory_order_relaxed) + 1; }
+
+  // Returns the new count. When it reaches zero, everything other owners did
+  // before dropping their references is visible to the caller.
+  int Dec() {
+    int prev = cnt_.fetch_sub(1, std::memory_order_release);
+    assert(prev > 0);
+    if (prev == 1) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    return prev - 1;
+  }
+
+ private:
+  std::atomic<int> cnt_{0};
+};
+
 template <typename T, void (*kDestroy)(T*)>
 class Ref {
  public:
   Ref() = default;
-  explicit Ref(T* val) : val_(val) {}
+
+  // Takes over a reference the caller already holds.
+  static Ref Adopt(T* val) { return Ref(val); }
 
   ~Ref() { Unref(); }
 
-  Ref(const Ref& other) { *this = other; }
+  Ref(const Ref& other) : val_(other.val_) {
+    if (val_ != nullptr) {
+      val_->IncRef();
+    }
+  }
   Ref& operator=(const Ref& other) {
+    if (other.val_ != nullptr) {
+      other.val_->IncRef();
+    }
     Unref();
     val_ = other.val_;
-    val_->IncRef();
     return *this;
   }
 
-  Ref(Ref&& other) { *this = other; }
+  Ref(Ref&& other) : val_(other.Release()) {}
   Ref& operator=(Ref&& other) {
-    Unref();
-    val_ = other.val_;
-    other.val_ = nullptr;
+    if (this != &other) {
+      Unref();
+      val_ = other.Release();
+    }
     return *this;
   }
 
-  explicit operator bool() { return val_ != nullptr; }
-  T* get() { return val_; }
-  T* operator->() { return get(); }
+  // Gives up ownership without dropping the reference.
+  [[nodiscard]] T* Release() {
+    T* val = val_;
+    val_ = nullptr;
+    return val;
+  }
+
+  explicit operator bool() const { return val_ != nullptr; }
+  T* get() const { return val_; }
+  T* operator->() const { return get(); }
 
  private:
+  explicit Ref(T* val) : val_(val) {}
+
   void Unref() {
     if (val_ == nullptr) {
       return;
@@ -1,17 +1,28 @@
 #ifndef STDIO_H_
 #define STDIO_H_
 
+#include <stdarg.h>
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define EOF (-1)
 
-// TODO(bcf): Implement for real.
-#define fprintf(stream, ...) printf(__VA_ARGS__)
+typedef struct FILE FILE;
+
+extern FILE *stdout;
+extern FILE *stderr;
 
 int printf(const char *format, ...);
+int fprintf(FILE *stream, const char *format, ...);
+int snprintf(char *str, size_t size, const char *format, ...);
+int vprintf(const char *format, va_list args);
+int vfprintf(FILE *stream, const char *format, va_list args);
+int vsnprintf(char *str, size_t size, const char *format, va_list args);
 int putchar(int c);
+// Unlike the standard `puts`, doesn't append a newline.
 int puts(const char *s);
 
 #ifdef __cplusplus
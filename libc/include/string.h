@@ -7,11 +7,13 @@
 extern "C" {
 #endif
 
+void* memchr(const void* s, int c, size_t n);
 int memcmp(const void* s1, const void* s2, size_t n);
 void* memcpy(void* __restrict dest, const void* __restrict src, size_t n);
 void* memmove(void* dest, const void* src, size_t n);
 void* memset(void* s, int c, size_t n);
 size_t strlen(const char* s);
+size_t strnlen(const char* s, size_t maxlen);
 
 #ifdef __cplusplus
 }
@@ -46,6 +46,16 @@ class IntrusiveList {
     node_.next_ = &node_;
   }
 
+  Node& front() {
+    assert(!empty());
+    return *node_.next_;
+  }
+
+  Node& back() {
+    assert(!empty());
+    return *node_.prev_;
+  }
+
   iterator begin() { return iterator(node_.next_); }
   iterator end() { return iterator(&node_); }
 
@@ -69,20 +79,20 @@ class IntrusiveList {
 #endif
   }
 
-  void push_back(Node& new_node) { node_.next_->InsertAfter(new_node); }
+  void push_back(Node& new_node) { node_.InsertBefore(new_node); }
 
-  void push_front(Node& new_node) { node_.prev_->InsertBefore(new_node); }
+  void push_front(Node& new_node) { node_.InsertAfter(new_node); }
 
  private:
   Node node_;
 };
 
-bool operator==(const IntrusiveList::iterator& lhs,
-                const IntrusiveList::iterator& rhs) {
+inline bool operator==(const IntrusiveList::iterator& lhs,
+                       const IntrusiveList::iterator& rhs) {
   return &*lhs == &*rhs;
 }
 
-bool operator!=(const IntrusiveList::iterator& lhs,
-                const IntrusiveList::iterator& rhs) {
+inline bool operator!=(const IntrusiveList::iterator& lhs,
+                       const IntrusiveList::iterator& rhs) {
   return &*lhs != &*rhs;
 }
@@ -15,7 +15,7 @@
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
 #define DIV_ROUND_UP(val, divisor) (((val) + (divisor)-1) / (divisor))
-#define ROUND_UP_TO(val, to_round) (DIV_ROUND_UP(val, to_round) * to_round)
+#define ROUND_UP_TO(val, to_round) (DIV_ROUND_UP(val, to_round) * (to_round))
 
 #define CONTAINER_OF(ptr, type, member) \
   (type*)((char*)(ptr)-offsetof(type, member))
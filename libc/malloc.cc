@@ -7,13 +7,27 @@
 #include <string.h>
 
 #include <algorithm>
+#include <new>
 
 #include "libc/intrusive-list.h"
 #include "libc/macros.h"
+#include "libc/page-map.h"
 #include "libc/tagged-val.h"
 
+#ifndef MALLOC_RETAIN_BYTES
+// Free memory the heap keeps cached before returning fully free pages to the
+// kernel. Keeps usage hovering around a page boundary from repeatedly mapping
+// and unmapping pages.
+#define MALLOC_RETAIN_BYTES (16 * PAGE_SIZE)
+#endif
+
 namespace {
 
+// Free memory held in free chunks and empty slabs.
+size_t g_cached_bytes = 0;
+
+bool ShouldReleasePages() { return g_cached_bytes >= MALLOC_RETAIN_BYTES; }
+
 constexpr int kTagBits = 2;
 static_assert((1 << kTagBits) <= alignof(uintptr_t));
 
@@ -67,26 +81,139 @@ Header* FreeNodeHeader(IntrusiveList::Node* node) {
   return reinterpret_cast<Header*>(node) - 1;
 }
 
-// Single free list with first fit allocation.
-// TODO(bcf): Use better scheme like free list per size.
-IntrusiveList g_free_list;
+IntrusiveList::Node* FreeNode(Header* header) {
+  return reinterpret_cast<IntrusiveList::Node*>(header + 1);
+}
+
+// Free chunks are kept in two level segregated fit (TLSF) lists. The first
+// level splits sizes into powers of two, and the second level splits each
+// power of two range into `kSlCount` equal ranges. Sizes below
+// `kSmallChunkSize` are split linearly. Bitmaps of non-empty lists make
+// finding a good fit O(1).
+constexpr int kSlShift = 4;
+constexpr int kSlCount = 1 << kSlShift;
+constexpr size_t kSmallChunkSize = kSlCount * alignof(max_align_t);
+
+// Index of the most significant set bit.
+constexpr int Fls(size_t val) {
+  return sizeof(unsigned long) * 8 - 1 - __builtin_clzl(val);
+}
+
+constexpr int kFlCount = sizeof(size_t) * 8 - Fls(kSmallChunkSize) + 1;
+static_assert(kSlCount <= 32);
+static_assert(kFlCount <= sizeof(unsigned long) * 8);
+
+unsigned long g_fl_bitmap = 0;
+uint32_t g_sl_bitmap[kFlCount] = {};
+IntrusiveList g_free_lists[kFlCount][kSlCount];
+
+// List a free chunk of `size` is kept on.
+void MappingInsert(size_t size, int* fl, int* sl) {
+  if (size < kSmallChunkSize) {
+    *fl = 0;
+    *sl = size / alignof(max_align_t);
+    return;
+  }
+
+  int fls = Fls(size);
+  *fl = fls - Fls(kSmallChunkSize) + 1;
+  *sl = (size >> (fls - kSlShift)) - kSlCount;
+}
+
+// First list whose chunks are all at least `size`. Returns false if `size` is
+// too large to be in any list.
+bool MappingSearch(size_t size, int* fl, int* sl) {
+  if (size >= kSmallChunkSize) {
+    size_t round = (size_t{1} << (Fls(size) - kSlShift)) - 1;
+    if (size + round < size) {
+      return false;
+    }
+    size += round;
+  }
 
-Header* AllocNode(size_t size) {
-  // We must add padding so the memory after the header is aligned.
-  static_assert(sizeof(Header) <= alignof(max_align_t));
-  size_t pad = alignof(max_align_t) - sizeof(Header);
+  MappingInsert(size, fl, sl);
+  return *fl < kFlCount;
+}
+
+void InsertFreeChunk(Header* header) {
+  assert(!header->used());
+
+  int fl;
+  int sl;
+  MappingInsert(header->size(), &fl, &sl);
+
+  g_free_lists[fl][sl].push_front(*FreeNode(header));
+  g_fl_bitmap |= 1ul << fl;
+  g_sl_bitmap[fl] |= 1u << sl;
+  g_cached_bytes += header->size();
+}
+
+void RemoveFreeChunk(Header* header) {
+  assert(!header->used());
+
+  int fl;
+  int sl;
+  MappingInsert(header->size(), &fl, &sl);
+
+  IntrusiveList& list = g_free_lists[fl][sl];
+  list.erase(*FreeNode(header));
+  g_cached_bytes -= header->size();
+  if (list.empty()) {
+    g_sl_bitmap[fl] &= ~(1u << sl);
+    if (g_sl_bitmap[fl] == 0) {
+      g_fl_bitmap &= ~(1ul << fl);
+    }
+  }
+}
+
+// Removes and returns a free chunk of at least `size`, or nullptr.
+Header* FindFreeChunk(size_t size) {
+  int fl;
+  int sl;
+  if (!MappingSearch(size, &fl, &sl)) {
+    return nullptr;
+  }
+
+  uint32_t sl_map = g_sl_bitmap[fl] & (~0u << sl);
+  if (sl_map == 0) {
+    // Shifting by the width of the type is undefined.
+    unsigned long fl_map = 0;
+    if (fl + 1 < kFlCount) {
+      fl_map = g_fl_bitmap & (~0ul << (fl + 1));
+    }
+    if (fl_map == 0) {
+      return nullptr;
+    }
 
-  size_t min_alloc_size = pad + size + sizeof(Header) + sizeof(Footer);
+    fl = __builtin_ctzl(fl_map);
+    sl_map = g_sl_bitmap[fl];
+  }
+  sl = __builtin_ctz(sl_map);
+
+  Header* header = FreeNodeHeader(&*g_free_lists[fl][sl].begin());
+  assert(header->size() >= size);
+  RemoveFreeChunk(header);
+  return header;
+}
+
+// We must add padding so the memory after the header is aligned.
+static_assert(sizeof(Header) <= alignof(max_align_t));
+constexpr size_t kNodePad = alignof(max_align_t) - sizeof(Header);
+
+Header* AllocNode(size_t size, bool zeroed) {
+  size_t min_alloc_size = kNodePad + size + sizeof(Header) + sizeof(Footer);
   size_t num_pages = DIV_ROUND_UP(min_alloc_size, PAGE_SIZE);
 
-  char* mem = reinterpret_cast<char*>(__malloc_alloc_pages(num_pages));
+  char* mem =
+      reinterpret_cast<char*>(__malloc_alloc_pages(num_pages, zeroed));
   if (mem == nullptr) {
     return nullptr;
   }
   size_t real_size = num_pages * PAGE_SIZE;
-  size_t payload_size = real_size - pad - sizeof(Header) - sizeof(Footer);
+  size_t payload_size =
+      real_size - kNodePad - sizeof(Header) - sizeof(Footer);
 
-  auto* header = reinterpret_cast<Header*>(mem + pad);
+  auto* header = reinterpret_cast<Header*>(mem + kNodePad);
   header->set_size(payload_size);
   header->set_used(false);
   header->set_has_next(false);
@@ -113,24 +240,14 @@ size_t SizeRound(size_t size) {
   return size;
 }
 
-void* MallocImpl(size_t size, bool* is_new_pages) {
+// With `zeroed`, the payload is zero when `is_new_pages` is set.
+void* HeapAlloc(size_t size, bool zeroed, bool* is_new_pages) {
   *is_new_pages = false;
   size = SizeRound(size);
 
-  Header* old_header = nullptr;
-  for (auto& link : g_free_list) {
-    Header* header = FreeNodeHeader(&link);
-    assert(!header->used());
-
-    if (header->size() >= size) {
-      g_free_list.erase(link);
-      old_header = header;
-      break;
-    }
-  }
-
+  Header* old_header = FindFreeChunk(size);
   if (old_header == nullptr) {
-    old_header = AllocNode(size);
+    old_header = AllocNode(size, zeroed);
     if (old_header == nullptr) {
       return nullptr;
     }
@@ -163,9 +280,10 @@ void* MallocImpl(size_t size, bool* is_new_pages) {
   new_header->set_size(remain - (sizeof(Header) + sizeof(Footer)));
   new_header->set_has_next(true);
   new_header->set_used(false);
+  assert(new_header->GetFooter() == old_footer);
+  old_footer->set_size(new_header->size());
 
-  auto* new_link = reinterpret_cast<IntrusiveList::Node*>(new_header + 1);
-  g_free_list.push_front(*new_link);
+  InsertFreeChunk(new_header);
 
   uintptr_t ret = (uintptr_t)(old_header + 1);
   assert(ret % alignof(max_align_t) == 0);
@@ -186,8 +304,7 @@ Header* TryCoalesceHeader(Header* header) {
   Header* prev_header = prev_footer->GetHeader();
   assert(!prev_header->used());
 
-  auto* node = reinterpret_cast<IntrusiveList::Node*>(prev_header + 1);
-  g_free_list.erase(*node);
+  RemoveFreeChunk(prev_header);
 
   size_t new_size =
       header->size() + prev_header->size() + sizeof(Header) + sizeof(Footer);
@@ -206,8 +323,7 @@ Footer* TryCoalesceFooter(Footer* footer) {
   if (next_header->used()) {
     return footer;
   }
-  auto* node = reinterpret_cast<IntrusiveList::Node*>(next_header + 1);
-  g_free_list.erase(*node);
+  RemoveFreeChunk(next_header);
 
   Header* header = footer->GetHeader();
 
@@ -222,18 +338,220 @@ Footer* TryCoalesceFooter(Footer* footer) {
   return next_footer;
 }
 
-}  // namespace
+// Small allocations are served from slabs of equally sized objects. Each size
+// class keeps a list of slabs with free objects, and each slab keeps its free
+// objects on an embedded list, so allocation and free are O(1) and objects
+// carry no header.
 
-void* malloc(size_t size) {
-  bool is_new_pages;
-  return MallocImpl(size, &is_new_pages);
+// What `g_page_map` records for a page. Pages not owned by a slab or a large
+// allocation are part of the boundary tag heap.
+constexpr uintptr_t kPageKindMask = 3;
+constexpr uintptr_t kPageKindHeap = 0;
+constexpr uintptr_t kPageKindSlab = 1;
+constexpr uintptr_t kPageKindLarge = 2;
+
+PageMap g_page_map;
+
+constexpr int kMinSlabShift = 3;
+constexpr int kMaxSlabShift = 11;
+constexpr int kNumSizeClasses = kMaxSlabShift - kMinSlabShift + 1;
+constexpr size_t kMaxSlabSize = size_t{1} << kMaxSlabShift;
+
+struct FreeObject {
+  FreeObject* next;
+};
+
+struct alignas(kPageKindMask + 1) Slab {
+  IntrusiveList::Node link;
+  FreeObject* free_list = nullptr;
+  uint16_t num_used = 0;
+  uint16_t num_objs = 0;
+  uint8_t size_class = 0;
+};
+
+// Objects start after the slab header, aligned so objects of 16 bytes or more
+// are suitably aligned for any type.
+constexpr size_t kSlabHeaderSize =
+    ROUND_UP_TO(sizeof(Slab), alignof(max_align_t));
+
+// Slabs with at least one free object, per size class.
+IntrusiveList g_partial_slabs[kNumSizeClasses];
+
+int SizeClass(size_t size) {
+  if (size <= (size_t{1} << kMinSlabShift)) {
+    return 0;
+  }
+
+  int shift = sizeof(unsigned) * 8 - __builtin_clz(size - 1);
+  return shift - kMinSlabShift;
 }
 
-void free(void* ptr) {
-  if (ptr == nullptr) {
+size_t ObjectSize(int size_class) {
+  return size_t{1} << (size_class + kMinSlabShift);
+}
+
+// Larger classes use multi-page slabs so the header doesn't waste most of the
+// slab.
+size_t SlabPages(int size_class) {
+  return std::max<size_t>(1, ObjectSize(size_class) * 8 / PAGE_SIZE);
+}
+
+Slab* NewSlab(int size_class) {
+  const size_t num_pages = SlabPages(size_class);
+  char* mem =
+      reinterpret_cast<char*>(__malloc_alloc_pages(num_pages, false));
+  if (mem == nullptr) {
+    return nullptr;
+  }
+
+  auto* slab = new (mem) Slab;
+  auto slab_val = reinterpret_cast<uintptr_t>(slab) | kPageKindSlab;
+
+  for (size_t i = 0; i < num_pages; ++i) {
+    if (!g_page_map.Set(mem + i * PAGE_SIZE, slab_val)) {
+      while (i-- > 0) {
+        g_page_map.Set(mem + i * PAGE_SIZE, kPageKindHeap);
+      }
+      __malloc_free_page(mem, num_pages);
+      return nullptr;
+    }
+  }
+
+  const size_t obj_size = ObjectSize(size_class);
+  const size_t num_objs = (num_pages * PAGE_SIZE - kSlabHeaderSize) / obj_size;
+  slab->size_class = size_class;
+  slab->num_objs = num_objs;
+
+  // Thread objects in address order.
+  char* objs = mem + kSlabHeaderSize;
+  FreeObject** tail = &slab->free_list;
+  for (size_t i = 0; i < num_objs; ++i) {
+    auto* obj = reinterpret_cast<FreeObject*>(objs + i * obj_size);
+    *tail = obj;
+    tail = &obj->next;
+  }
+  *tail = nullptr;
+
+  // Empty until `SlabAlloc` takes its first object.
+  g_cached_bytes += num_pages * PAGE_SIZE;
+  return slab;
+}
+
+void* SlabAlloc(int size_class) {
+  IntrusiveList& partial = g_partial_slabs[size_class];
+  if (partial.empty()) {
+    Slab* slab = NewSlab(size_class);
+    if (slab == nullptr) {
+      return nullptr;
+    }
+    partial.push_front(slab->link);
+  }
+
+  Slab* slab = CONTAINER_OF(&*partial.begin(), Slab, link);
+  FreeObject* obj = slab->free_list;
+  assert(obj != nullptr);
+
+  if (slab->num_used == 0) {
+    g_cached_bytes -= SlabPages(size_class) * PAGE_SIZE;
+  }
+
+  slab->free_list = obj->next;
+  ++slab->num_used;
+  if (slab->free_list == nullptr) {
+    partial.erase(slab->link);
+  }
+
+  return obj;
+}
+
+void SlabFree(Slab* slab, void* ptr) {
+  assert(slab->num_used > 0);
+  assert((reinterpret_cast<char*>(ptr) - reinterpret_cast<char*>(slab) -
+          kSlabHeaderSize) %
+             ObjectSize(slab->size_class) ==
+         0);
+
+  // Full slabs aren't on the partial list.
+  if (slab->free_list == nullptr) {
+    g_partial_slabs[slab->size_class].push_front(slab->link);
+  }
+
+  auto* obj = reinterpret_cast<FreeObject*>(ptr);
+  obj->next = slab->free_list;
+  slab->free_list = obj;
+  if (--slab->num_used > 0) {
     return;
   }
 
+  // Keep at least one slab per class so a single object being allocated and
+  // freed doesn't map and unmap a slab each time.
+  IntrusiveList& partial = g_partial_slabs[slab->size_class];
+  const bool is_only_slab = ++partial.begin() == partial.end();
+  const size_t num_pages = SlabPages(slab->size_class);
+  if (is_only_slab || !ShouldReleasePages()) {
+    g_cached_bytes += num_pages * PAGE_SIZE;
+    return;
+  }
+
+  partial.erase(slab->link);
+  char* mem = reinterpret_cast<char*>(slab);
+  for (size_t i = 0; i < num_pages; ++i) {
+    g_page_map.Set(mem + i * PAGE_SIZE, kPageKindHeap);
+  }
+  __malloc_free_page(mem, num_pages);
+}
+
+// Allocations of at least a page get their own pages straight from the kernel,
+// so they don't fragment the heap. The first page's `g_page_map` entry records
+// the size.
+constexpr size_t kMinLargeSize = PAGE_SIZE;
+
+void* LargeAlloc(size_t size, bool zeroed) {
+  const size_t num_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+  void* mem = __malloc_alloc_pages(num_pages, zeroed);
+  if (mem == nullptr) {
+    return nullptr;
+  }
+
+  size = ROUND_UP_TO(size, kPageKindMask + 1);
+  if (!g_page_map.Set(mem, size | kPageKindLarge)) {
+    __malloc_free_page(mem, num_pages);
+    return nullptr;
+  }
+
+  return mem;
+}
+
+void LargeFree(void* ptr, size_t size) {
+  assert(reinterpret_cast<uintptr_t>(ptr) % PAGE_SIZE == 0);
+
+  g_page_map.Set(ptr, kPageKindHeap);
+  __malloc_free_page(ptr, DIV_ROUND_UP(size, PAGE_SIZE));
+}
+
+// `zeroed` asks for new pages to be zeroed, so memory is zero whenever
+// `is_new_pages` is set.
+void* MallocImpl(size_t size, bool zeroed, bool* is_new_pages) {
+  if (size >= kMinLargeSize) {
+    *is_new_pages = true;
+    void* ret = LargeAlloc(size, zeroed);
+    if (ret != nullptr) {
+      return ret;
+    }
+  } else if (size <= kMaxSlabSize) {
+    *is_new_pages = false;
+    void* ret = SlabAlloc(SizeClass(size));
+    if (ret != nullptr) {
+      return ret;
+    }
+  }
+
+  // The page map may fail to allocate a leaf when pages run out. The boundary
+  // tag heap doesn't need it.
+  return HeapAlloc(size, zeroed, is_new_pages);
+}
+
+void HeapFree(void* ptr) {
   Header* header = FreeNodeHeader(reinterpret_cast<IntrusiveList::Node*>(ptr));
   assert(header->used());
 
@@ -246,18 +564,61 @@ void free(void* ptr) {
   header = TryCoalesceHeader(header);
   footer = TryCoalesceFooter(footer);
 
-  // TODO(bcf): Return fully freed pages to kernel.
+  // The chunk spans an entire node.
+  if (!header->has_next() && !footer->has_next() && ShouldReleasePages()) {
+    size_t node_size =
+        kNodePad + sizeof(Header) + header->size() + sizeof(Footer);
+    assert(node_size % PAGE_SIZE == 0);
+
+    __malloc_free_page(reinterpret_cast<char*>(header) - kNodePad,
+                       node_size / PAGE_SIZE);
+    return;
+  }
+
+  InsertFreeChunk(header);
+}
 
-  auto* link = reinterpret_cast<IntrusiveList::Node*>(header + 1);
-  g_free_list.push_front(*link);
+}  // namespace
+
+void* malloc(size_t size) {
+  bool is_new_pages;
+  return MallocImpl(size, /*zeroed=*/false, &is_new_pages);
+}
+
+void free(void* ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+
+  const uintptr_t page_val = g_page_map.Get(ptr);
+  switch (page_val & kPageKindMask) {
+    case kPageKindSlab:
+      SlabFree(reinterpret_cast<Slab*>(page_val & ~kPageKindMask), ptr);
+      return;
+    case kPageKindLarge:
+      LargeFree(ptr, page_val & ~kPageKindMask);
+      return;
+    default:
+      assert((page_val & kPageKindMask) == kPageKindHeap);
+      HeapFree(ptr);
+      return;
+  }
 }
 
 void* calloc(size_t nmemb, size_t size) {
   size_t size_bytes = nmemb * size;
   bool is_new_pages;
-  void* ret = MallocImpl(size_bytes, &is_new_pages);
+  void* ret = MallocImpl(size_bytes, /*zeroed=*/true, &is_new_pages);
+  if (ret == nullptr) {
+    return nullptr;
+  }
 
-#ifndef LIBC_IS_LIBK
+#ifdef LIBC_IS_LIBK
+  // The kernel hands out new pages zeroed.
+  if (is_new_pages) {
+    return ret;
+  }
+#else
   // TODO(bcf): In userspace we can avoid memset if `is_new_pages` is true due
   // to COW zero page.
 #endif
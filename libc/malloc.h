@@ -1,13 +1,15 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-void* __malloc_alloc_pages(size_t count);
-void __malloc_free_page(void* addr);
+// Pages are zeroed if `zeroed` is set.
+void* __malloc_alloc_pages(size_t count, bool zeroed);
+void __malloc_free_page(void* addr, size_t num_pages);
 
 #ifdef __cplusplus
 }
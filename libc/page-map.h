@@ -0,0 +1,63 @@
+#pragma once
+
+#include <arch.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "libc/malloc.h"
+
+// Maps each page of a 32 bit address space to a word of allocator metadata.
+// Unset pages map to 0.
+//
+// Two level radix tree. Leaves are allocated with `__malloc_alloc_pages` the
+// first time a page they cover is set.
+class PageMap {
+ public:
+  PageMap() = default;
+
+  PageMap(const PageMap&) = delete;
+  PageMap& operator=(const PageMap&) = delete;
+
+  uintptr_t Get(const void* addr) const {
+    uintptr_t page = reinterpret_cast<uintptr_t>(addr) / PAGE_SIZE;
+    assert(page / kLeafSize < kRootSize);
+
+    const uintptr_t* leaf = root_[page / kLeafSize];
+    if (leaf == nullptr) {
+      return 0;
+    }
+
+    return leaf[page % kLeafSize];
+  }
+
+  // Returns false if a leaf couldn't be allocated.
+  bool Set(const void* addr, uintptr_t val) {
+    uintptr_t page = reinterpret_cast<uintptr_t>(addr) / PAGE_SIZE;
+    assert(page / kLeafSize < kRootSize);
+
+    uintptr_t*& leaf = root_[page / kLeafSize];
+    if (leaf == nullptr) {
+      if (val == 0) {
+        return true;
+      }
+
+      leaf = reinterpret_cast<uintptr_t*>(
+          __malloc_alloc_pages(1, /*zeroed=*/true));
+      if (leaf == nullptr) {
+        return false;
+      }
+    }
+
+    leaf[page % kLeafSize] = val;
+    return true;
+  }
+
+ private:
+  static constexpr size_t kLeafSize = PAGE_SIZE / sizeof(uintptr_t);
+  static constexpr size_t kRootSize = (1ull << 32) / PAGE_SIZE / kLeafSize;
+
+  uintptr_t* root_[kRootSize] = {};
+};
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef LIBC_IS_LIBK
 #include "core/tty.h"
@@ -11,214 +12,626 @@
 
 #include "libc/macros.h"
 
-typedef struct {
-  const char* restrict format;
-  int remain;
-} PrintfState;
+struct FILE {
+  int fd;
+};
+
+static FILE g_stdout = {1};
+static FILE g_stderr = {2};
+
+FILE* stdout = &g_stdout;
+FILE* stderr = &g_stderr;
+
+// Bytes `vfprintf` collects on the stack before writing them out.
+enum { kStreamBufferSize = 128 };
+
+static int file_write(FILE* stream, const char* data, size_t size) {
+  (void)stream;
 
-static int printf_int(PrintfState* state, bool is_negtive,
-                      unsigned long long val, int pad_digits) {
-  char buf[32];
-  int idx = 0;
+#ifdef LIBC_IS_LIBK
+  TtyWrite(data, size);
+#else
+  // TODO(bcf): Write to `stream->fd` once there are syscalls.
+  (void)data;
+  (void)size;
+#endif  // LIBC_IS_LIBK
+
+  return 0;
+}
 
-  while (val != 0) {
-    buf[idx++] = '0' + val % 10;
-    val /= 10;
+// Where `vformat` writes. Output collects in `buf`. Once it is full it is
+// flushed to `stream`, or without a stream the rest is dropped.
+typedef struct {
+  char* buf;
+  size_t cap;
+  size_t len;
+  FILE* stream;
+  // Bytes produced so far, dropped ones included.
+  size_t total;
+} FormatSink;
+
+static int sink_flush(FormatSink* sink) {
+  if (sink->stream == NULL || sink->len == 0) {
+    return 0;
+  }
+
+  if (file_write(sink->stream, sink->buf, sink->len) < 0) {
+    return -1;
   }
+  sink->len = 0;
+  return 0;
+}
 
-  for (int i = idx; i < pad_digits; ++i) {
-    if (putchar('0') == EOF) {
+static int sink_write(FormatSink* sink, const char* data, size_t size) {
+  sink->total += size;
+
+  // Too big to be worth buffering.
+  if (sink->stream != NULL && size >= sink->cap) {
+    if (sink_flush(sink) < 0) {
       return -1;
     }
+    return file_write(sink->stream, data, size);
+  }
+
+  while (size > 0) {
+    if (sink->len == sink->cap) {
+      if (sink->stream == NULL) {
+        return 0;
+      }
+      if (sink_flush(sink) < 0) {
+        return -1;
+      }
+    }
+
+    const size_t count = MIN(size_t, size, sink->cap - sink->len);
+    memcpy(sink->buf + sink->len, data, count);
+    sink->len += count;
+    data += count;
+    size -= count;
   }
 
-  if (is_negtive) {
-    buf[idx++] = '-';
+  return 0;
+}
+
+static int sink_putc(FormatSink* sink, char c) {
+  if (sink->len < sink->cap) {
+    sink->buf[sink->len++] = c;
+    ++sink->total;
+    return 0;
   }
 
-  while (idx > 0) {
-    if (state->remain-- == 0) {
-      // TODO: Set errno to EOVERFLOW.
-      return -1;
-    }
+  return sink_write(sink, &c, 1);
+}
 
-    if (putchar(buf[--idx]) == EOF) {
+// Returns where the next `size` bytes go in `sink->buf`, flushing first if
+// needed, or NULL if they don't fit. Commit them with `sink_commit`.
+static char* sink_reserve(FormatSink* sink, size_t size) {
+  if (sink->cap - sink->len < size && sink->stream != NULL &&
+      sink_flush(sink) < 0) {
+    return NULL;
+  }
+  if (sink->cap - sink->len < size) {
+    return NULL;
+  }
+
+  return sink->buf + sink->len;
+}
+
+static void sink_commit(FormatSink* sink, size_t size) {
+  sink->len += size;
+  sink->total += size;
+}
+
+static int sink_pad(FormatSink* sink, char c, size_t count) {
+  static const char kSpaces[] = "                ";
+  static const char kZeros[] = "0000000000000000";
+  const char* const pad = c == '0' ? kZeros : kSpaces;
+
+  while (count > 0) {
+    const size_t chunk = MIN(size_t, count, sizeof(kSpaces) - 1);
+    if (sink_write(sink, pad, chunk) < 0) {
       return -1;
     }
+    count -= chunk;
   }
 
   return 0;
 }
 
-static int printf_hex(PrintfState* state, unsigned long long val,
-                      int pad_digits) {
-  static const char kLut[] = {
-      '0', '1', '2', '3', '4', '5', '6', '7',
-      '8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+// A conversion's flags, width and precision.
+typedef struct {
+  bool left;
+  bool zero;
+  // '+', ' ' or '\0', shown before non-negative numbers.
+  char sign;
+  int width;
+  // -1 if not given.
+  int precision;
+} FormatSpec;
+
+// Upper bound of the digits of an unsigned long long in any base we print.
+enum { kMaxDigits = 22 };
+
+// "00", "01", ..., "99".
+static const char kDigitPairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const char kHexLower[] = "0123456789abcdef";
+static const char kHexUpper[] = "0123456789ABCDEF";
+
+static int dec_len(unsigned long long val) {
+  static const unsigned long long kPow10[] = {
+      1ULL,
+      10ULL,
+      100ULL,
+      1000ULL,
+      10000ULL,
+      100000ULL,
+      1000000ULL,
+      10000000ULL,
+      100000000ULL,
+      1000000000ULL,
+      10000000000ULL,
+      100000000000ULL,
+      1000000000000ULL,
+      10000000000000ULL,
+      100000000000000ULL,
+      1000000000000000ULL,
+      10000000000000000ULL,
+      100000000000000000ULL,
+      1000000000000000000ULL,
+      10000000000000000000ULL,
   };
-  _Static_assert(ARRAY_SIZE(kLut) == 16);
 
-  char buf[32];
-  int idx = 0;
+  int len = 1;
+  while (len < (int)ARRAY_SIZE(kPow10) && val >= kPow10[len]) {
+    ++len;
+  }
+  return len;
+}
 
-  while (val != 0) {
-    buf[idx++] = kLut[val % 16];
-    val /= 16;
+static int hex_len(unsigned long long val) {
+  int len = 1;
+  while ((val >>= 4) != 0) {
+    ++len;
   }
+  return len;
+}
 
-  for (int i = idx; i < pad_digits; ++i) {
-    if (putchar('0') == EOF) {
-      return -1;
-    }
+// Writes the digits of `val` so they end at `end`, two at a time. Returns
+// where they start.
+static char* u32_to_dec(char* end, uint32_t val) {
+  while (val >= 100) {
+    const uint32_t pair = val % 100;
+    val /= 100;
+    end -= 2;
+    end[0] = kDigitPairs[pair * 2];
+    end[1] = kDigitPairs[pair * 2 + 1];
   }
 
-  while (idx > 0) {
-    if (state->remain-- == 0) {
-      // TODO: Set errno to EOVERFLOW.
-      return -1;
-    }
+  if (val >= 10) {
+    end -= 2;
+    end[0] = kDigitPairs[val * 2];
+    end[1] = kDigitPairs[val * 2 + 1];
+  } else {
+    *(--end) = '0' + val;
+  }
 
-    if (putchar(buf[--idx]) == EOF) {
-      return -1;
+  return end;
+}
+
+// Same as `u32_to_dec`. Values above 32 bits lose nine digits per 64 bit
+// division, since each of those is a libgcc call on i386, and the rest is
+// done in 32 bits.
+static char* u64_to_dec(char* end, unsigned long long val) {
+  while (val > UINT32_MAX) {
+    const unsigned long long high = val / 1000000000;
+    char* const chunk_end = end;
+    end = u32_to_dec(end, val - high * 1000000000);
+    val = high;
+    while (chunk_end - end < 9) {
+      *(--end) = '0';
     }
   }
 
-  return 0;
+  return u32_to_dec(end, val);
 }
 
-int printf(const char* restrict format, ...) {
-  va_list args;
-  va_start(args, format);
+static char* u64_to_hex(char* end, unsigned long long val, bool upper) {
+  const char* const lut = upper ? kHexUpper : kHexLower;
+
+  // Avoid 64 bit shifts when the value fits.
+  if (val <= UINT32_MAX) {
+    uint32_t val32 = val;
+    do {
+      *(--end) = lut[val32 & 0xf];
+      val32 >>= 4;
+    } while (val32 != 0);
+    return end;
+  }
 
-  PrintfState state;
-  state.format = format;
-  state.remain = INT_MAX;
+  do {
+    *(--end) = lut[val & 0xf];
+    val >>= 4;
+  } while (val != 0);
+  return end;
+}
 
-  while (*state.format != '\0') {
-    if (state.remain == 0) {
-      // TODO: Set errno to EOVERFLOW.
-      return -1;
+// Prints `val` in base 10 or 16 after `prefix`, padded as `spec` says.
+// Digits are converted straight into the sink's buffer when they fit.
+static int format_number(FormatSink* sink, const FormatSpec* spec,
+                         const char* prefix, unsigned long long val,
+                         int base, bool upper) {
+  const size_t prefix_len = strlen(prefix);
+
+  // A precision of 0 prints nothing for 0.
+  size_t num_digits = 0;
+  if (val != 0 || spec->precision != 0) {
+    num_digits = base == 10 ? dec_len(val) : hex_len(val);
+  }
+
+  size_t num_zeros = 0;
+  if (spec->precision >= 0) {
+    if ((size_t)spec->precision > num_digits) {
+      num_zeros = spec->precision - num_digits;
     }
+  } else if (spec->zero && !spec->left &&
+             (size_t)spec->width > prefix_len + num_digits) {
+    num_zeros = spec->width - prefix_len - num_digits;
+  }
+
+  const size_t len = prefix_len + num_zeros + num_digits;
+  const size_t num_spaces =
+      (size_t)spec->width > len ? spec->width - len : 0;
 
-    if (*state.format != '%') {
-      if (putchar(*state.format) == EOF) {
+  if (!spec->left && sink_pad(sink, ' ', num_spaces) < 0) {
+    return -1;
+  }
+  if (sink_write(sink, prefix, prefix_len) < 0 ||
+      sink_pad(sink, '0', num_zeros) < 0) {
+    return -1;
+  }
+
+  if (num_digits > 0) {
+    char* dest = sink_reserve(sink, num_digits);
+    if (dest != NULL) {
+      char* const end = dest + num_digits;
+      if (base == 10) {
+        u64_to_dec(end, val);
+      } else {
+        u64_to_hex(end, val, upper);
+      }
+      sink_commit(sink, num_digits);
+    } else {
+      char buf[kMaxDigits];
+      char* const end = buf + sizeof(buf);
+      const char* start =
+          base == 10 ? u64_to_dec(end, val) : u64_to_hex(end, val, upper);
+      if (sink_write(sink, start, end - start) < 0) {
         return -1;
       }
-      ++state.format;
-      --state.remain;
-      continue;
     }
+  }
 
-    const char* format_start = state.format++;
+  if (spec->left && sink_pad(sink, ' ', num_spaces) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int format_str(FormatSink* sink, const FormatSpec* spec,
+                      const char* str, size_t len) {
+  const size_t num_spaces =
+      (size_t)spec->width > len ? spec->width - len : 0;
+
+  if (!spec->left && sink_pad(sink, ' ', num_spaces) < 0) {
+    return -1;
+  }
+  if (sink_write(sink, str, len) < 0) {
+    return -1;
+  }
+  if (spec->left && sink_pad(sink, ' ', num_spaces) < 0) {
+    return -1;
+  }
 
-    if (*state.format == '%') {
-      ++state.format;
-      if (putchar('%') == EOF) {
+  return 0;
+}
+
+// Length modifiers of integer conversions.
+typedef enum {
+  kLengthNone,
+  kLengthChar,
+  kLengthShort,
+  kLengthLong,
+  kLengthLongLong,
+  kLengthSize,
+} FormatLength;
+
+// Parses a non-negative decimal number, advancing `format` past it.
+static int parse_int(const char* restrict* format) {
+  int val = 0;
+  while (**format >= '0' && **format <= '9') {
+    val = val * 10 + (*((*format)++) - '0');
+  }
+  return val;
+}
+
+// Formats into `sink`. Returns -1 on error, with `sink->total` holding the
+// length of the output otherwise.
+static int vformat(FormatSink* sink, const char* restrict format,
+                   va_list args) {
+  while (*format != '\0') {
+    if (*format != '%') {
+      // Copy text up to the next conversion in one go.
+      const char* end = format;
+      while (*end != '\0' && *end != '%') {
+        ++end;
+      }
+      if (sink_write(sink, format, end - format) < 0) {
         return -1;
       }
-      --state.remain;
+      format = end;
       continue;
     }
 
-    if (*state.format == 'd') {
-      ++state.format;
+    const char* format_start = format++;
+
+    FormatSpec spec = {false, false, '\0', 0, -1};
+    for (;; ++format) {
+      if (*format == '-') {
+        spec.left = true;
+      } else if (*format == '0') {
+        spec.zero = true;
+      } else if (*format == '+') {
+        spec.sign = '+';
+      } else if (*format == ' ') {
+        if (spec.sign == '\0') {
+          spec.sign = ' ';
+        }
+      } else {
+        break;
+      }
+    }
 
-      int val = va_arg(args, int);
-      unsigned long long ull_val = val < 0 ? -val : val;
+    if (*format == '*') {
+      ++format;
+      spec.width = va_arg(args, int);
+      if (spec.width < 0) {
+        spec.left = true;
+        spec.width = -spec.width;
+      }
+    } else {
+      spec.width = parse_int(&format);
+    }
 
-      if (printf_int(&state, val < 0, ull_val, 1) < 0) {
-        return -1;
+    if (*format == '.') {
+      ++format;
+      if (*format == '*') {
+        ++format;
+        spec.precision = va_arg(args, int);
+        if (spec.precision < 0) {
+          spec.precision = -1;
+        }
+      } else {
+        spec.precision = parse_int(&format);
       }
-      continue;
     }
 
-    if (*state.format == 'x') {
-      ++state.format;
+    FormatLength length = kLengthNone;
+    if (*format == 'h') {
+      ++format;
+      length = kLengthShort;
+      if (*format == 'h') {
+        ++format;
+        length = kLengthChar;
+      }
+    } else if (*format == 'l') {
+      ++format;
+      length = kLengthLong;
+      if (*format == 'l') {
+        ++format;
+        length = kLengthLongLong;
+      }
+    } else if (*format == 'z') {
+      ++format;
+      length = kLengthSize;
+    }
+
+    const char conversion = *format++;
 
-      if (printf_hex(&state, va_arg(args, unsigned), 1) < 0) {
+    if (conversion == '%') {
+      if (sink_putc(sink, '%') < 0) {
         return -1;
       }
       continue;
     }
 
-    if (*state.format == 's') {
-      ++state.format;
+    if (conversion == 'd' || conversion == 'i') {
+      long long val;
+      switch (length) {
+        case kLengthChar:
+          val = (signed char)va_arg(args, int);
+          break;
+        case kLengthShort:
+          val = (short)va_arg(args, int);
+          break;
+        case kLengthLong:
+          val = va_arg(args, long);
+          break;
+        case kLengthLongLong:
+          val = va_arg(args, long long);
+          break;
+        case kLengthSize:
+          // There is no ssize_t, but it would be the same size.
+          val = (intptr_t)va_arg(args, size_t);
+          break;
+        default:
+          val = va_arg(args, int);
+          break;
+      }
 
-      const char* str = va_arg(args, const char*);
-      while (*str) {
-        if (state.remain-- == 0) {
-          // TODO: Set errno to EOVERFLOW.
-          return -1;
-        }
+      char prefix[2] = {spec.sign, '\0'};
+      unsigned long long magnitude = val;
+      if (val < 0) {
+        prefix[0] = '-';
+        magnitude = 0 - magnitude;
+      }
 
-        if (putchar(*(str++)) == EOF) {
-          return -1;
-        }
+      if (format_number(sink, &spec, prefix, magnitude, 10, false) < 0) {
+        return -1;
       }
       continue;
     }
 
-    if (*state.format == 'p') {
-      ++state.format;
+    if (conversion == 'u' || conversion == 'x' || conversion == 'X') {
+      unsigned long long val;
+      switch (length) {
+        case kLengthChar:
+          val = (unsigned char)va_arg(args, unsigned);
+          break;
+        case kLengthShort:
+          val = (unsigned short)va_arg(args, unsigned);
+          break;
+        case kLengthLong:
+          val = va_arg(args, unsigned long);
+          break;
+        case kLengthLongLong:
+          val = va_arg(args, unsigned long long);
+          break;
+        case kLengthSize:
+          val = va_arg(args, size_t);
+          break;
+        default:
+          val = va_arg(args, unsigned);
+          break;
+      }
 
-      if (state.remain < 2) {
-        // TODO: Set errno to EOVERFLOW.
+      const int base = conversion == 'u' ? 10 : 16;
+      if (format_number(sink, &spec, "", val, base, conversion == 'X') < 0) {
         return -1;
       }
-      if (puts("0x") < 0) {
+      continue;
+    }
+
+    if (conversion == 's') {
+      const char* str = va_arg(args, const char*);
+      const size_t len = spec.precision >= 0 ? strnlen(str, spec.precision)
+                                             : strlen(str);
+      if (format_str(sink, &spec, str, len) < 0) {
         return -1;
       }
-      state.remain -= 2;
+      continue;
+    }
 
+    if (conversion == 'p') {
       uintptr_t val = (uintptr_t)va_arg(args, void*);
-      if (printf_hex(&state, val, /*pad_digits=*/sizeof(void*) * 2) < 0) {
+      if (spec.precision < 0) {
+        spec.precision = sizeof(void*) * 2;
+      }
+      if (format_number(sink, &spec, "0x", val, 16, false) < 0) {
         return -1;
       }
       continue;
     }
 
-    if (*state.format == 'c') {
-      ++state.format;
-
+    if (conversion == 'c') {
       // char promotes to int.
-      if (putchar(va_arg(args, int)) == EOF) {
+      const char c = va_arg(args, int);
+      if (format_str(sink, &spec, &c, 1) < 0) {
         return -1;
       }
-
-      --state.remain;
       continue;
     }
 
     // Unsupported format, just print the rest of the format.
-    state.format = format_start;
-    while (*state.format) {
-      if (state.remain-- == 0) {
-        // TODO: Set errno to EOVERFLOW.
-        return -1;
-      }
-
-      if (putchar(*(state.format++)) == EOF) {
-        return -1;
-      }
+    if (sink_write(sink, format_start, strlen(format_start)) < 0) {
+      return -1;
     }
     break;
   }
 
+  return 0;
+}
+
+// Result of a printf family call which produced `sink->total` bytes.
+static int format_result(const FormatSink* sink) {
+  if (sink->total > INT_MAX) {
+    // TODO: Set errno to EOVERFLOW.
+    return -1;
+  }
+
+  return sink->total;
+}
+
+int vsnprintf(char* restrict str, size_t size, const char* restrict format,
+              va_list args) {
+  // Leave room for the terminator.
+  FormatSink sink = {str, size > 0 ? size - 1 : 0, 0, NULL, 0};
+  const int err = vformat(&sink, format, args);
+  if (size > 0) {
+    str[sink.len] = '\0';
+  }
+
+  return err < 0 ? -1 : format_result(&sink);
+}
+
+int snprintf(char* restrict str, size_t size, const char* restrict format,
+             ...) {
+  va_list args;
+  va_start(args, format);
+  const int ret = vsnprintf(str, size, format, args);
   va_end(args);
-  return INT_MAX - state.remain;
+  return ret;
+}
+
+int vfprintf(FILE* restrict stream, const char* restrict format,
+             va_list args) {
+  char buf[kStreamBufferSize];
+  FormatSink sink = {buf, sizeof(buf), 0, stream, 0};
+  if (vformat(&sink, format, args) < 0 || sink_flush(&sink) < 0) {
+    return -1;
+  }
+
+  return format_result(&sink);
+}
+
+int fprintf(FILE* restrict stream, const char* restrict format, ...) {
+  va_list args;
+  va_start(args, format);
+  const int ret = vfprintf(stream, format, args);
+  va_end(args);
+  return ret;
+}
+
+int vprintf(const char* restrict format, va_list args) {
+  return vfprintf(stdout, format, args);
+}
+
+int printf(const char* restrict format, ...) {
+  va_list args;
+  va_start(args, format);
+  const int ret = vfprintf(stdout, format, args);
+  va_end(args);
+  return ret;
 }
 
 int putchar(int c) {
-#ifdef LIBC_IS_LIBK
-  TtyPutchar(c);
-#endif  // LIBC_IS_LIBK
+  const char ch = c;
+  if (file_write(stdout, &ch, 1) < 0) {
+    return EOF;
+  }
 
-  return c;
+  return (unsigned char)c;
 }
 
 int puts(const char* s) {
-  while (*s != '\0') {
-    putchar(*(s++));
+  if (file_write(stdout, s, strlen(s)) < 0) {
+    return EOF;
   }
 
   return 0;
@@ -0,0 +1,24 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Switches large `memcpy`, `memmove` and `memset` calls to single `rep movsb`
+// and `rep stosb` instructions, for CPUs with enhanced REP MOVSB/STOSB.
+void __string_use_erms(void);
+
+// Switches large `memcpy`, `memmove` and `memset` calls to SSE2. Only call
+// this once the CPU supports SSE2 and SSE is enabled.
+void __string_use_sse2(void);
+
+#ifdef LIBC_IS_LIBK
+// Bracket the SSE2 routines so the kernel can preserve the registers of code
+// they interrupt.
+void __string_fpu_begin(void);
+void __string_fpu_end(void);
+#endif  // LIBC_IS_LIBK
+
+#ifdef __cplusplus
+}
+#endif
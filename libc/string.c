@@ -1,9 +1,271 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
+#include "libc/macros.h"
+#include "libc/string-impl.h"
+
+// Words may alias objects of any type. Unaligned words are only read where
+// the pointers can't both be aligned.
+typedef size_t __attribute__((__may_alias__)) Word;
+typedef size_t __attribute__((__may_alias__, __aligned__(1))) UnalignedWord;
+
+static const Word kWordOnes = (Word)-1 / UCHAR_MAX;
+static const Word kWordHighs = (Word)-1 / UCHAR_MAX * (UCHAR_MAX / 2 + 1);
+
+// Sizes from which the routines in `g_large_ops` are used.
+static const size_t kLargeSize = 512;
+
+// Whether any byte of `word` is zero.
+static inline bool has_zero(Word word) {
+  return ((word - kWordOnes) & ~word & kWordHighs) != 0;
+}
+
+// Bytes from `ptr` to the next word boundary, at most `n`.
+static inline size_t head_bytes(const void* ptr, size_t n) {
+  size_t head = (size_t)(-(uintptr_t)ptr % sizeof(Word));
+  return MIN(size_t, head, n);
+}
+
+// Copies with `dest` aligned, so stores never straddle a word.
+static void copy_forward(unsigned char* dest, const unsigned char* src,
+                         size_t n) {
+  size_t head = head_bytes(dest, n);
+  const size_t words = (n - head) / sizeof(Word);
+  const size_t tail = (n - head) % sizeof(Word);
+
+#ifdef __i386__
+  __asm__ __volatile__(
+      "rep movsb;"
+      "movl %3, %%ecx;"
+      "rep movsl;"
+      "movl %4, %%ecx;"
+      "rep movsb;"
+      : "+D"(dest), "+S"(src), "+c"(head)
+      : "r"(words), "r"(tail)
+      : "memory");
+#else
+  while (head--) {
+    *(dest++) = *(src++);
+  }
+  for (size_t i = 0; i < words; ++i) {
+    *(Word*)dest = *(const UnalignedWord*)src;
+    dest += sizeof(Word);
+    src += sizeof(Word);
+  }
+  for (size_t i = 0; i < tail; ++i) {
+    *(dest++) = *(src++);
+  }
+#endif
+}
+
+// Same as `copy_forward`, starting from the end.
+static void copy_backward(unsigned char* dest, const unsigned char* src,
+                          size_t n) {
+  size_t tail = (size_t)((uintptr_t)(dest + n) % sizeof(Word));
+  tail = MIN(size_t, tail, n);
+  const size_t words = (n - tail) / sizeof(Word);
+  const size_t head = (n - tail) % sizeof(Word);
+
+#ifdef __i386__
+  // Each run starts at its last element with the direction flag set.
+  dest += n - 1;
+  src += n - 1;
+  __asm__ __volatile__(
+      "std;"
+      "rep movsb;"
+      "subl $3, %%edi;"
+      "subl $3, %%esi;"
+      "movl %3, %%ecx;"
+      "rep movsl;"
+      "addl $3, %%edi;"
+      "addl $3, %%esi;"
+      "movl %4, %%ecx;"
+      "rep movsb;"
+      "cld;"
+      : "+D"(dest), "+S"(src), "+c"(tail)
+      : "r"(words), "r"(head)
+      : "memory");
+#else
+  dest += n;
+  src += n;
+  while (tail--) {
+    *(--dest) = *(--src);
+  }
+  for (size_t i = 0; i < words; ++i) {
+    dest -= sizeof(Word);
+    src -= sizeof(Word);
+    *(Word*)dest = *(const UnalignedWord*)src;
+  }
+  for (size_t i = 0; i < head; ++i) {
+    *(--dest) = *(--src);
+  }
+#endif
+}
+
+static void set(unsigned char* s, unsigned char c, size_t n) {
+  size_t head = head_bytes(s, n);
+  const size_t words = (n - head) / sizeof(Word);
+  const size_t tail = (n - head) % sizeof(Word);
+  const Word pattern = kWordOnes * c;
+
+#ifdef __i386__
+  __asm__ __volatile__(
+      "rep stosb;"
+      "movl %3, %%ecx;"
+      "rep stosl;"
+      "movl %4, %%ecx;"
+      "rep stosb;"
+      : "+D"(s), "+c"(head)
+      : "a"(pattern), "r"(words), "r"(tail)
+      : "memory");
+#else
+  while (head--) {
+    *(s++) = c;
+  }
+  for (size_t i = 0; i < words; ++i) {
+    *(Word*)s = pattern;
+    s += sizeof(Word);
+  }
+  for (size_t i = 0; i < tail; ++i) {
+    *(s++) = c;
+  }
+#endif
+}
+
+#ifdef __i386__
+
+// With ERMS, a single `rep movsb` is fastest once sizes are large.
+static void copy_erms(unsigned char* dest, const unsigned char* src,
+                      size_t n) {
+  __asm__ __volatile__("rep movsb;"
+                       : "+D"(dest), "+S"(src), "+c"(n)
+                       :
+                       : "memory");
+}
+
+static void set_erms(unsigned char* s, unsigned char c, size_t n) {
+  __asm__ __volatile__("rep stosb;" : "+D"(s), "+c"(n) : "a"(c) : "memory");
+}
+
+static inline void fpu_begin(void) {
+#ifdef LIBC_IS_LIBK
+  __string_fpu_begin();
+#endif
+}
+
+static inline void fpu_end(void) {
+#ifdef LIBC_IS_LIBK
+  __string_fpu_end();
+#endif
+}
+
+// 64 byte blocks per iteration, with `dest` aligned to 16 bytes. Copying
+// forward this way is also safe for `memmove` when `dest` is below `src`,
+// since each block is loaded before any of it is stored.
+//
+// The SSE instructions live only in the asm, between `fpu_begin` and
+// `fpu_end`. This file is built without SSE, so the compiler keeps nothing
+// in xmm registers and they can't be named as clobbers.
+static void copy_sse2(unsigned char* dest, const unsigned char* src,
+                      size_t n) {
+  const size_t head = MIN(size_t, (size_t)(-(uintptr_t)dest % 16), n);
+  copy_forward(dest, src, head);
+  dest += head;
+  src += head;
+  n -= head;
+
+  size_t blocks = n / 64;
+  if (blocks > 0) {
+    fpu_begin();
+    __asm__ __volatile__(
+        "1:;"
+        "movdqu (%1), %%xmm0;"
+        "movdqu 16(%1), %%xmm1;"
+        "movdqu 32(%1), %%xmm2;"
+        "movdqu 48(%1), %%xmm3;"
+        "movdqa %%xmm0, (%0);"
+        "movdqa %%xmm1, 16(%0);"
+        "movdqa %%xmm2, 32(%0);"
+        "movdqa %%xmm3, 48(%0);"
+        "addl $64, %0;"
+        "addl $64, %1;"
+        "decl %2;"
+        "jnz 1b;"
+        : "+r"(dest), "+r"(src), "+r"(blocks)
+        :
+        : "memory", "cc");
+    fpu_end();
+  }
+
+  copy_forward(dest, src, n % 64);
+}
+
+static void set_sse2(unsigned char* s, unsigned char c, size_t n) {
+  const size_t head = MIN(size_t, (size_t)(-(uintptr_t)s % 16), n);
+  set(s, c, head);
+  s += head;
+  n -= head;
+
+  size_t blocks = n / 64;
+  if (blocks > 0) {
+    fpu_begin();
+    __asm__ __volatile__(
+        "movd %2, %%xmm0;"
+        "pshufd $0, %%xmm0, %%xmm0;"
+        "1:;"
+        "movdqa %%xmm0, (%0);"
+        "movdqa %%xmm0, 16(%0);"
+        "movdqa %%xmm0, 32(%0);"
+        "movdqa %%xmm0, 48(%0);"
+        "addl $64, %0;"
+        "decl %1;"
+        "jnz 1b;"
+        : "+r"(s), "+r"(blocks)
+        : "r"(kWordOnes * c)
+        : "memory", "cc");
+    fpu_end();
+  }
+
+  set(s, c, n % 64);
+}
+
+#endif  // __i386__
+
+// Implementations for sizes from `kLargeSize`, chosen at runtime.
+static struct {
+  void (*copy_forward)(unsigned char* dest, const unsigned char* src,
+                       size_t n);
+  void (*set)(unsigned char* s, unsigned char c, size_t n);
+} g_large_ops = {copy_forward, set};
+
+void __string_use_erms(void) {
+#ifdef __i386__
+  g_large_ops.copy_forward = copy_erms;
+  g_large_ops.set = set_erms;
+#endif
+}
+
+void __string_use_sse2(void) {
+#ifdef __i386__
+  g_large_ops.copy_forward = copy_sse2;
+  g_large_ops.set = set_sse2;
+#endif
+}
+
 int memcmp(const void* s1, const void* s2, size_t n) {
   const unsigned char* s1_char = s1;
   const unsigned char* s2_char = s2;
 
+  // Skip equal words, then find the first differing byte.
+  while (n >= sizeof(Word) && *(const UnalignedWord*)s1_char ==
+                                  *(const UnalignedWord*)s2_char) {
+    s1_char += sizeof(Word);
+    s2_char += sizeof(Word);
+    n -= sizeof(Word);
+  }
+
   while (n--) {
     unsigned char c1 = *(s1_char++);
     unsigned char c2 = *(s2_char++);
@@ -19,51 +281,111 @@ int memcmp(const void* s1, const void* s2, size_t n) {
 }
 
 void* memcpy(void* restrict dest, const void* restrict src, size_t n) {
-  char* dest_char = dest;
-  const char* src_char = src;
-
-  while (n--) {
-    *(dest_char++) = *(src_char++);
+  if (n >= kLargeSize) {
+    g_large_ops.copy_forward(dest, src, n);
+  } else {
+    copy_forward(dest, src, n);
   }
 
   return dest;
 }
 
 void* memmove(void* dest, const void* src, size_t n) {
-  char* dest_char = dest;
-  const char* src_char = src;
+  unsigned char* dest_char = dest;
+  const unsigned char* src_char = src;
 
   if (dest_char < src_char) {
-    while (n--) {
-      *(dest_char++) = *(src_char++);
-    }
-  } else {
-    dest_char += n;
-    src_char += n;
-
-    while (n--) {
-      *(--dest_char) = *(--src_char);
+    if (n >= kLargeSize) {
+      g_large_ops.copy_forward(dest_char, src_char, n);
+    } else {
+      copy_forward(dest_char, src_char, n);
     }
+  } else if (dest_char > src_char) {
+    copy_backward(dest_char, src_char, n);
   }
 
   return dest;
 }
 
 void* memset(void* s, int c, size_t n) {
-  unsigned char* buf = s;
+  if (n >= kLargeSize) {
+    g_large_ops.set(s, c, n);
+  } else {
+    set(s, c, n);
+  }
+
+  return s;
+}
+
+void* memchr(const void* s, int c, size_t n) {
+  const unsigned char* buf = s;
+  const unsigned char target = c;
+
+  size_t head = head_bytes(buf, n);
+  n -= head;
+  while (head--) {
+    if (*buf == target) {
+      return (void*)buf;
+    }
+    ++buf;
+  }
+
+  const Word pattern = kWordOnes * target;
+  while (n >= sizeof(Word) && !has_zero(*(const Word*)buf ^ pattern)) {
+    buf += sizeof(Word);
+    n -= sizeof(Word);
+  }
 
   while (n--) {
-    *(buf++) = c;
+    if (*buf == target) {
+      return (void*)buf;
+    }
+    ++buf;
   }
 
-  return s;
+  return NULL;
 }
 
 size_t strlen(const char* s) {
-  size_t len = 0;
-  while (*(s++) != '\0') {
-    ++len;
+  const char* end = s;
+  while ((uintptr_t)end % sizeof(Word) != 0) {
+    if (*end == '\0') {
+      return end - s;
+    }
+    ++end;
+  }
+
+  // Aligned words never cross a page, so reading past the terminator is safe.
+  while (!has_zero(*(const Word*)end)) {
+    end += sizeof(Word);
+  }
+
+  while (*end != '\0') {
+    ++end;
+  }
+
+  return end - s;
+}
+
+size_t strnlen(const char* s, size_t maxlen) {
+  const char* end = s;
+  size_t head = head_bytes(end, maxlen);
+  size_t remain = maxlen - head;
+  while (head--) {
+    if (*end == '\0') {
+      return end - s;
+    }
+    ++end;
+  }
+
+  while (remain >= sizeof(Word) && !has_zero(*(const Word*)end)) {
+    end += sizeof(Word);
+    remain -= sizeof(Word);
+  }
+
+  while (remain-- > 0 && *end != '\0') {
+    ++end;
   }
 
-  return len;
+  return end - s;
 }
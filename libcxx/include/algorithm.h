@@ -8,6 +8,11 @@ const T& max(const T& a, const T& b) {
   return (a < b) ? b : a;
 }
 
+template <typename T>
+const T& min(const T& a, const T& b) {
+  return (b < a) ? b : a;
+}
+
 }  // namespace std
 
 #endif  // LIBCXX_ALGORITHM_H_
@@ -0,0 +1,72 @@
+#ifndef LIBCXX_ATOMIC_H_
+#define LIBCXX_ATOMIC_H_
+
+namespace std {
+
+enum memory_order {
+  memory_order_relaxed = __ATOMIC_RELAXED,
+  memory_order_consume = __ATOMIC_CONSUME,
+  memory_order_acquire = __ATOMIC_ACQUIRE,
+  memory_order_release = __ATOMIC_RELEASE,
+  memory_order_acq_rel = __ATOMIC_ACQ_REL,
+  memory_order_seq_cst = __ATOMIC_SEQ_CST,
+};
+
+inline void atomic_thread_fence(memory_order order) {
+  __atomic_thread_fence(order);
+}
+
+// Only integral and pointer types which fit in a word.
+template <typename T>
+struct atomic {
+  atomic() = default;
+  constexpr atomic(T desired) : val_(desired) {}
+
+  atomic(const atomic&) = delete;
+  atomic& operator=(const atomic&) = delete;
+
+  T load(memory_order order = memory_order_seq_cst) const {
+    return __atomic_load_n(&val_, order);
+  }
+
+  void store(T desired, memory_order order = memory_order_seq_cst) {
+    __atomic_store_n(&val_, desired, order);
+  }
+
+  T exchange(T desired, memory_order order = memory_order_seq_cst) {
+    return __atomic_exchange_n(&val_, desired, order);
+  }
+
+  bool compare_exchange_strong(T& expected, T desired,
+                               memory_order order = memory_order_seq_cst) {
+    return __atomic_compare_exchange_n(&val_, &expected, desired, false, order,
+                                       FailureOrder(order));
+  }
+
+  T fetch_add(T arg, memory_order order = memory_order_seq_cst) {
+    return __atomic_fetch_add(&val_, arg, order);
+  }
+
+  T fetch_sub(T arg, memory_order order = memory_order_seq_cst) {
+    return __atomic_fetch_sub(&val_, arg, order);
+  }
+
+  operator T() const { return load(); }
+
+ private:
+  static constexpr memory_order FailureOrder(memory_order order) {
+    if (order == memory_order_acq_rel) {
+      return memory_order_acquire;
+    }
+    if (order == memory_order_release) {
+      return memory_order_relaxed;
+    }
+    return order;
+  }
+
+  T val_;
+};
+
+}  // namespace std
+
+#endif  // LIBCXX_ATOMIC_H_